@@ -0,0 +1,361 @@
+#include "headers/AudioKernels.h"
+
+#include <bitset>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define OBS_VST_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX instructions in functions marked for them, MSVC takes the intrinsics anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define OBS_VST_TARGET(isa) __attribute__((target(isa)))
+#else
+#define OBS_VST_TARGET(isa)
+#endif
+
+namespace AudioKernels {
+
+namespace {
+
+struct Kernels {
+	const char *name;
+	void (*crossfade)(float *dst, const float *from, const float *to, const uint32_t frames);
+	uint32_t (*sanitize)(float *data, const uint32_t frames);
+};
+
+// Scalar
+//
+
+void crossfadeScalar(float *dst, const float *from, const float *to, const uint32_t frames)
+{
+	for (uint32_t i = 0; i < frames; i++) {
+		const float gain = float(i) / frames;
+		dst[i] = from[i] * (1.0f - gain) + to[i] * gain;
+	}
+}
+
+uint32_t sanitizeScalar(float *data, const uint32_t frames)
+{
+	uint32_t bad = 0;
+
+	for (uint32_t i = 0; i < frames; i++) {
+		const float magnitude = std::fabs(data[i]);
+
+		// NaN fails both comparisons
+		if (!(magnitude <= FLT_MAX))
+			bad++;
+
+		if (!(magnitude <= FLT_MAX) || magnitude < FLT_MIN)
+			data[i] = 0.0f;
+	}
+
+	return bad;
+}
+
+#ifdef OBS_VST_X86
+
+// SSE2
+//
+
+OBS_VST_TARGET("sse2") void crossfadeSse2(float *dst, const float *from, const float *to, const uint32_t frames)
+{
+	const __m128 step = _mm_set1_ps(1.0f / frames);
+	const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	uint32_t i = 0;
+
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 gain = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(float(i)), lanes), step);
+		const __m128 a = _mm_mul_ps(_mm_loadu_ps(from + i), _mm_sub_ps(one, gain));
+		_mm_storeu_ps(dst + i, _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(to + i), gain)));
+	}
+
+	for (; i < frames; i++) {
+		const float gain = float(i) / frames;
+		dst[i] = from[i] * (1.0f - gain) + to[i] * gain;
+	}
+}
+
+OBS_VST_TARGET("sse2") uint32_t sanitizeSse2(float *data, const uint32_t frames)
+{
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 largest = _mm_set1_ps(FLT_MAX);
+	const __m128 smallest = _mm_set1_ps(FLT_MIN);
+	uint32_t bad = 0;
+	uint32_t i = 0;
+
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 v = _mm_loadu_ps(data + i);
+		const __m128 magnitude = _mm_and_ps(v, signMask);
+		const __m128 finite = _mm_cmple_ps(magnitude, largest);
+
+		bad += uint32_t(std::bitset<4>(~_mm_movemask_ps(finite) & 0xf).count());
+		_mm_storeu_ps(data + i, _mm_and_ps(v, _mm_and_ps(finite, _mm_cmpge_ps(magnitude, smallest))));
+	}
+
+	return bad + sanitizeScalar(data + i, frames - i);
+}
+
+// AVX2
+//
+
+OBS_VST_TARGET("avx2") void crossfadeAvx2(float *dst, const float *from, const float *to, const uint32_t frames)
+{
+	const __m256 step = _mm256_set1_ps(1.0f / frames);
+	const __m256 lanes = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	uint32_t i = 0;
+
+	for (; i + 8 <= frames; i += 8) {
+		const __m256 gain = _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(float(i)), lanes), step);
+		const __m256 a = _mm256_mul_ps(_mm256_loadu_ps(from + i), _mm256_sub_ps(one, gain));
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(to + i), gain)));
+	}
+
+	for (; i < frames; i++) {
+		const float gain = float(i) / frames;
+		dst[i] = from[i] * (1.0f - gain) + to[i] * gain;
+	}
+}
+
+OBS_VST_TARGET("avx2") uint32_t sanitizeAvx2(float *data, const uint32_t frames)
+{
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 largest = _mm256_set1_ps(FLT_MAX);
+	const __m256 smallest = _mm256_set1_ps(FLT_MIN);
+	uint32_t bad = 0;
+	uint32_t i = 0;
+
+	for (; i + 8 <= frames; i += 8) {
+		const __m256 v = _mm256_loadu_ps(data + i);
+		const __m256 magnitude = _mm256_and_ps(v, signMask);
+		const __m256 finite = _mm256_cmp_ps(magnitude, largest, _CMP_LE_OQ);
+
+		bad += uint32_t(std::bitset<8>(~_mm256_movemask_ps(finite) & 0xff).count());
+		_mm256_storeu_ps(data + i, _mm256_and_ps(v, _mm256_and_ps(finite, _mm256_cmp_ps(magnitude, smallest, _CMP_GE_OQ))));
+	}
+
+	return bad + sanitizeScalar(data + i, frames - i);
+}
+
+// AVX-512
+//
+
+OBS_VST_TARGET("avx512f") void crossfadeAvx512(float *dst, const float *from, const float *to, const uint32_t frames)
+{
+	const __m512 step = _mm512_set1_ps(1.0f / frames);
+	const __m512 lanes = _mm512_set_ps(15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f, 7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+	const __m512 one = _mm512_set1_ps(1.0f);
+	uint32_t i = 0;
+
+	for (; i + 16 <= frames; i += 16) {
+		const __m512 gain = _mm512_mul_ps(_mm512_add_ps(_mm512_set1_ps(float(i)), lanes), step);
+		const __m512 a = _mm512_mul_ps(_mm512_loadu_ps(from + i), _mm512_sub_ps(one, gain));
+		_mm512_storeu_ps(dst + i, _mm512_add_ps(a, _mm512_mul_ps(_mm512_loadu_ps(to + i), gain)));
+	}
+
+	for (; i < frames; i++) {
+		const float gain = float(i) / frames;
+		dst[i] = from[i] * (1.0f - gain) + to[i] * gain;
+	}
+}
+
+OBS_VST_TARGET("avx512f") uint32_t sanitizeAvx512(float *data, const uint32_t frames)
+{
+	const __m512 largest = _mm512_set1_ps(FLT_MAX);
+	const __m512 smallest = _mm512_set1_ps(FLT_MIN);
+	uint32_t bad = 0;
+	uint32_t i = 0;
+
+	for (; i + 16 <= frames; i += 16) {
+		const __m512 v = _mm512_loadu_ps(data + i);
+		const __m512 magnitude = _mm512_abs_ps(v);
+		const __mmask16 finite = _mm512_cmp_ps_mask(magnitude, largest, _CMP_LE_OQ);
+		const __mmask16 keep = _mm512_mask_cmp_ps_mask(finite, magnitude, smallest, _CMP_GE_OQ);
+
+		bad += uint32_t(std::bitset<16>(uint16_t(~finite)).count());
+		_mm512_storeu_ps(data + i, _mm512_maskz_mov_ps(keep, v));
+	}
+
+	return bad + sanitizeScalar(data + i, frames - i);
+}
+
+enum InstructionSet { Scalar, Sse2, Avx2, Avx512 };
+
+// What the CPU and the OS's saved register state both support
+InstructionSet detect()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+
+	if (!sse2)
+		return Scalar;
+
+	if (!osxsave || maxLeaf < 7)
+		return Sse2;
+
+	const unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+
+	if ((info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6)
+		return Avx512;
+
+	if ((info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6)
+		return Avx2;
+
+	return Sse2;
+#else
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return Avx512;
+
+	if (__builtin_cpu_supports("avx2"))
+		return Avx2;
+
+	if (__builtin_cpu_supports("sse2"))
+		return Sse2;
+
+	return Scalar;
+#endif
+}
+
+#endif
+
+Kernels select()
+{
+	static const Kernels variants[] = {
+		{"scalar", crossfadeScalar, sanitizeScalar},
+#ifdef OBS_VST_X86
+		{"SSE2", crossfadeSse2, sanitizeSse2},
+		{"AVX2", crossfadeAvx2, sanitizeAvx2},
+		{"AVX-512", crossfadeAvx512, sanitizeAvx512},
+#endif
+	};
+
+	int best = 0;
+
+#ifdef OBS_VST_X86
+	best = detect();
+#endif
+
+	// OBS_VST_KERNELS=scalar|sse2|avx2|avx512 caps the choice, for comparing variants on one machine
+	const char *cap = getenv("OBS_VST_KERNELS");
+	static const char *const caps[] = {"scalar", "sse2", "avx2", "avx512"};
+
+	for (int i = 0; cap != nullptr && i < int(sizeof(caps) / sizeof(caps[0])); i++) {
+		if (strcmp(cap, caps[i]) == 0 && i < best)
+			best = i;
+	}
+
+	return variants[best];
+}
+
+const Kernels active = select();
+
+// A Channels of 0 is a count only known at run time, the others unroll
+template<int Channels> void copyPlanesN(float *const *dst, const float *const *src, const int channels, const uint32_t frames)
+{
+	for (int c = 0; c < (Channels > 0 ? Channels : channels); c++)
+		memcpy(dst[c], src[c], frames * sizeof(float));
+}
+
+template<int Channels> void zeroPlanesN(float *const *planes, const int channels, const uint32_t frames)
+{
+	for (int c = 0; c < (Channels > 0 ? Channels : channels); c++)
+		memset(planes[c], 0, frames * sizeof(float));
+}
+
+template<int Channels> uint32_t sanitizePlanesN(float *const *planes, const int channels, const uint32_t frames)
+{
+	uint32_t bad = 0;
+
+	for (int c = 0; c < (Channels > 0 ? Channels : channels); c++)
+		bad += active.sanitize(planes[c], frames);
+
+	return bad;
+}
+
+template<int Channels> void packPlanesN(float *dst, const float *const *src, const int channels, const uint32_t frames)
+{
+	for (int c = 0; c < (Channels > 0 ? Channels : channels); c++)
+		memcpy(dst + size_t(c) * frames, src[c], frames * sizeof(float));
+}
+
+template<int Channels> void unpackPlanesN(float *const *dst, const float *src, const int channels, const uint32_t frames)
+{
+	for (int c = 0; c < (Channels > 0 ? Channels : channels); c++)
+		memcpy(dst[c], src + size_t(c) * frames, frames * sizeof(float));
+}
+
+}
+
+// Mono, stereo, 5.1 and 7.1 get their own copies of the loop
+#define OBS_VST_BY_CHANNELS(kernel, channels, ...)                 \
+	switch (channels) {                                        \
+	case 1:                                                    \
+		return kernel<1>(__VA_ARGS__);                     \
+	case 2:                                                    \
+		return kernel<2>(__VA_ARGS__);                     \
+	case 6:                                                    \
+		return kernel<6>(__VA_ARGS__);                     \
+	case 8:                                                    \
+		return kernel<8>(__VA_ARGS__);                     \
+	default:                                                   \
+		return kernel<0>(__VA_ARGS__);                     \
+	}
+
+const char *instructionSet()
+{
+	return active.name;
+}
+
+void crossfade(float *dst, const float *from, const float *to, const uint32_t frames)
+{
+	active.crossfade(dst, from, to, frames);
+}
+
+uint32_t sanitize(float *data, const uint32_t frames)
+{
+	return active.sanitize(data, frames);
+}
+
+void copyPlanes(float *const *dst, const float *const *src, const int channels, const uint32_t frames)
+{
+	OBS_VST_BY_CHANNELS(copyPlanesN, channels, dst, src, channels, frames)
+}
+
+void zeroPlanes(float *const *planes, const int channels, const uint32_t frames)
+{
+	OBS_VST_BY_CHANNELS(zeroPlanesN, channels, planes, channels, frames)
+}
+
+uint32_t sanitizePlanes(float *const *planes, const int channels, const uint32_t frames)
+{
+	OBS_VST_BY_CHANNELS(sanitizePlanesN, channels, planes, channels, frames)
+}
+
+void packPlanes(float *dst, const float *const *src, const int channels, const uint32_t frames)
+{
+	OBS_VST_BY_CHANNELS(packPlanesN, channels, dst, src, channels, frames)
+}
+
+void unpackPlanes(float *const *dst, const float *src, const int channels, const uint32_t frames)
+{
+	OBS_VST_BY_CHANNELS(unpackPlanesN, channels, dst, src, channels, frames)
+}
+
+}
@@ -0,0 +1,181 @@
+#include "headers/ProxyProcess.h"
+
+#include <obs-module.h>
+#include <grpcpp/grpcpp.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace ProxyProcesses {
+
+static std::mutex proxiesMutex;
+static std::map<std::string, std::shared_ptr<ProxyProcess>> proxies;
+
+static std::shared_ptr<ProxyProcess> spareProxy;
+static std::thread spareThread;
+static bool spareWarming{false};
+static bool spareStopping{false};
+
+std::shared_ptr<ProxyProcess> join(const std::string &group)
+{
+	if (group.empty())
+		return nullptr;
+
+	std::lock_guard<std::mutex> grd(proxiesMutex);
+	auto it = proxies.find(group);
+
+	// A crashed proxy stays registered until its last filter lets go of it
+	if (it == proxies.end() || !isRunning(*it->second))
+		return nullptr;
+
+	it->second->users++;
+	return it->second;
+}
+
+void publish(const std::string &group, const std::shared_ptr<ProxyProcess> &proxy)
+{
+	if (group.empty())
+		return;
+
+	std::lock_guard<std::mutex> grd(proxiesMutex);
+	proxies[group] = proxy;
+}
+
+bool leave(const std::shared_ptr<ProxyProcess> &proxy)
+{
+	std::lock_guard<std::mutex> grd(proxiesMutex);
+
+	if (--proxy->users > 0)
+		return false;
+
+	for (auto it = proxies.begin(); it != proxies.end(); ++it) {
+		if (it->second == proxy) {
+			proxies.erase(it);
+			break;
+		}
+	}
+
+	return true;
+}
+
+std::shared_ptr<ProxyProcess> takeSpare()
+{
+	std::lock_guard<std::mutex> grd(proxiesMutex);
+	std::shared_ptr<ProxyProcess> spare = std::move(spareProxy);
+
+	if (spare == nullptr)
+		return nullptr;
+
+	if (!isRunning(*spare)) {
+		end(*spare, 0);
+		return nullptr;
+	}
+
+	spare->users = 1;
+	return spare;
+}
+
+void warmSpare()
+{
+	std::lock_guard<std::mutex> grd(proxiesMutex);
+
+	if (spareStopping || spareWarming || spareProxy != nullptr)
+		return;
+
+	// Done warming, so this returns right away
+	if (spareThread.joinable())
+		spareThread.join();
+
+	spareWarming = true;
+	spareThread = std::thread([]() {
+		std::shared_ptr<ProxyProcess> spare = start(std::string());
+
+		// Connecting now is what saves the next filter the wait
+		const auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(5);
+
+		if (spare != nullptr && !spare->channel->WaitForConnected(deadline)) {
+			blog(LOG_WARNING, "VST Plug-in: spare proxy on port %d didn't come up", spare->port);
+			end(*spare, 0);
+			spare = nullptr;
+		}
+
+		// The client falls back to the control connection if this one never comes up
+		if (spare != nullptr)
+			spare->audioChannel->WaitForConnected(deadline);
+
+		std::lock_guard<std::mutex> grd(proxiesMutex);
+		spareWarming = false;
+
+		if (spare == nullptr)
+			return;
+
+		if (spareStopping) {
+			kill(*spare);
+			return;
+		}
+
+		spareProxy = spare;
+	});
+}
+
+void stopSpare()
+{
+	std::thread warming;
+	std::shared_ptr<ProxyProcess> spare;
+
+	{
+		std::lock_guard<std::mutex> grd(proxiesMutex);
+		spareStopping = true;
+		warming = std::move(spareThread);
+		spare = std::move(spareProxy);
+	}
+
+	if (warming.joinable())
+		warming.join();
+
+	if (spare != nullptr)
+		kill(*spare);
+}
+
+uint32_t currentProcessId()
+{
+#ifdef WIN32
+	return uint32_t(GetCurrentProcessId());
+#else
+	return uint32_t(getpid());
+#endif
+}
+
+bool takePorts(const std::string &report, ProxyProcess &proxy)
+{
+	int port = 0;
+	int audioPort = 0;
+
+	// A proxy whose audio server didn't come up reports 0 for it
+	if (sscanf(report.c_str(), "%d %d", &port, &audioPort) != 2 || port <= 0)
+		return false;
+
+	proxy.port = port;
+	proxy.audioPort = audioPort;
+	return true;
+}
+
+void openChannels(ProxyProcess &proxy)
+{
+	proxy.channel = grpc::CreateChannel("localhost:" + std::to_string(proxy.port), grpc::InsecureChannelCredentials());
+
+	// A proxy without an audio port serves blocks on the control connection
+	if (proxy.audioPort != 0)
+		proxy.audioChannel = grpc::CreateChannel("localhost:" + std::to_string(proxy.audioPort), grpc::InsecureChannelCredentials());
+	else
+		proxy.audioChannel = proxy.channel;
+}
+
+}
@@ -16,11 +16,14 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *****************************************************************************/
 
+#include <algorithm>
 #include <vector>
 
 #include "headers/VSTPlugin.h"
 #include "win/VstWinDefs.h"
 #include "headers/grpc_vst_communicatorClient.h"
+#include "headers/ProxyProcess.h"
+#include "headers/AudioKernels.h"
 
 #define CBASE64_IMPLEMENTATION
 #include "cbase64.h"
@@ -35,43 +38,50 @@ VSTPlugin::VSTPlugin(obs_source_t *sourceContext) : m_sourceContext{sourceContex
 	memset(m_effectName, 0, sizeof(m_effectName));
 	memset(m_vendorString, 0, sizeof(m_vendorString));
 
-	int numChannels = VST_MAX_CHANNELS;
-	int blocksize = BLOCK_SIZE;
+	// Unrouted plug-in inputs read this
+	m_silence.assign(MAX_BLOCK_SIZE, 0.0f);
 
-	m_inputs = (float **)malloc(sizeof(float **) * numChannels);
-	m_outputs = (float **)malloc(sizeof(float **) * numChannels);
+	// Room for every row there can be, so switching reblocking on or rerouting never allocates on the audio thread
+	m_reblockInput.assign(size_t(VST_MAX_CHANNELS) * ReblockCapacity, 0.0f);
+	m_reblockOutput.assign(size_t(VST_MAX_CHANNELS) * ReblockCapacity, 0.0f);
 
-	for (int channel = 0; channel < numChannels; channel++) {
-		m_inputs[channel] = (float *)malloc(sizeof(float *) * blocksize);
-		m_outputs[channel] = (float *)malloc(sizeof(float *) * blocksize);
+	m_outputData.assign(size_t(VST_MAX_CHANNELS) * MAX_BLOCK_SIZE, 0.0f);
+	m_pluginOutputData.assign(size_t(VST_MAX_CHANNELS) * MAX_BLOCK_SIZE, 0.0f);
+	m_lastBlock.assign(size_t(VST_MAX_CHANNELS) * MAX_BLOCK_SIZE, 0.0f);
+
+	for (int c = 0; c < VST_MAX_CHANNELS; c++) {
+		m_outputs[c] = &m_outputData[size_t(c) * MAX_BLOCK_SIZE];
+		m_pluginOutputs[c] = &m_pluginOutputData[size_t(c) * MAX_BLOCK_SIZE];
 	}
+
+	// Pipelining can be switched on at any time, its lines and the inputs of blocks in flight are there already
+	m_delayCapacity = 2 * grpc_vst_communicatorClient::MaxPendingBlocks * MAX_BLOCK_SIZE;
+	m_delayLine.assign(size_t(VST_MAX_CHANNELS) * m_delayCapacity, 0.0f);
+	m_inFlight.resize(grpc_vst_communicatorClient::MaxPendingBlocks);
+	m_inFlightInputs.assign(m_inFlight.size() * VST_MAX_CHANNELS * MAX_BLOCK_SIZE, 0.0f);
+
+	// OBS filters have no latency of their own, so it's published for whoever compensates sync offsets
+	signal_handler_add(obs_source_get_signal_handler(m_sourceContext), "void latency_changed(ptr source, int frames, int latency_ns)");
+	proc_handler_add(obs_source_get_proc_handler(m_sourceContext), "void get_latency(out int frames, out int latency_ns)", getLatencyProc, this);
+
+	// Disabled filters are skipped by OBS, so the chain around this one changes with it
+	signal_handler_connect(obs_source_get_signal_handler(m_sourceContext), "enable", onEnabledChanged, this);
+
+	m_controlThread = std::thread(&VSTPlugin::runControl, this);
 }
 
 VSTPlugin::~VSTPlugin()
 {
-	int numChannels = VST_MAX_CHANNELS;
-
-	for (int channel = 0; channel < numChannels; channel++) {
-		if (m_inputs[channel]) {
-			free(m_inputs[channel]);
-			m_inputs[channel] = NULL;
-		}
+	signal_handler_disconnect(obs_source_get_signal_handler(m_sourceContext), "enable", onEnabledChanged, this);
+	beginDestroy();
 
-		if (m_outputs[channel]) {
-			free(m_outputs[channel]);
-			m_outputs[channel] = NULL;
-		}
-	}
+	m_controlStop = true;
+	m_controlWakeup.post();
 
-	if (m_inputs) {
-		free(m_inputs);
-		m_inputs = NULL;
-	}
+	if (m_controlThread.joinable())
+		m_controlThread.join();
 
-	if (m_outputs) {
-		free(m_outputs);
-		m_outputs = NULL;
-	}
+	unwatchParent();
 }
 
 void VSTPlugin::loadEffectFromPath(std::string path)
@@ -107,13 +117,24 @@ void VSTPlugin::loadEffectFromPath(std::string path)
 	auto sampleRate = audio_output_get_sample_rate(obs_get_audio());
 	m_remote->dispatcher(m_effect.get(), effSetSampleRate, 0, 0, nullptr, static_cast<float>(sampleRate), 0);
 
-	int blocksize = BLOCK_SIZE;
-	m_remote->dispatcher(m_effect.get(), effSetBlockSize, 0, blocksize, nullptr, 0.0f, 0);
+	// A whole tick per block, one round trip per OBS audio call. Adaptive sizing only goes down from here
+	m_blockSize = MAX_BLOCK_SIZE;
+	m_requestedBlockSize = 0;
+	m_blockCallMs = 0.0;
+	m_blockCalls = 0;
+
+	m_remote->dispatcher(m_effect.get(), effSetBlockSize, 0, m_blockSize, nullptr, 0.0f, 0);
 	m_remote->dispatcher(m_effect.get(), effMainsChanged, 0, 1, nullptr, 0, 0);
 
 	if (!verifyProxy())
 		return;
 
+	// Plug-ins usually settle their delay when resumed
+	updateLatency();
+
+	// Filters before this one may take it into their chains now
+	requestChainUpdates();
+
 	if (m_openInterfaceWhenActive)
 		openEditor();
 }
@@ -127,39 +148,245 @@ bool VSTPlugin::verifyProxy(const bool notifyAudioPause /*= false*/)
 		return false;
 
 	if (m_remote != nullptr) {
-		m_proxyDisconnected = !m_remote->m_connected;
+		// A proxy that exited is noticed on the next block even when no RPC has failed yet, shared memory audio only misses its deadline
+		const bool lost = !m_remote->m_connected || (m_proxy != nullptr && !ProxyProcesses::isRunning(*m_proxy));
 
-		if (m_proxyDisconnected) {
-			std::string msg;
+		if (!lost)
+			return true;
 
-			if (notifyAudioPause)
-				msg = (std::filesystem::path(m_pluginPath).filename().string() +
-				       " has stopped working.\n\nThe audio it modifies has paused and will continue after closing this popup but the filter is now disabled. You may restart the application or recreate the filter to enable it again.");
-			else
-				msg = (std::filesystem::path(m_pluginPath).filename().string() +
-				       " has stopped working.\n\nThe filter has been disabled. You may restart the application or recreate the filter to enable it again.");
+		// Audio and UI threads both get here, only the first to notice schedules the restart. Nothing is torn down from these threads
+		if (!m_proxyDisconnected.exchange(true)) {
+			blog(LOG_WARNING, "VST Plug-in: '%s' has stopped working%s", m_pluginPath.c_str(),
+			     notifyAudioPause ? ", its audio passes through unprocessed until the proxy is back" : "");
 
-#ifdef WIN32
-			::MessageBoxA(GetDesktopWindow(), msg.c_str(), "VST Filter Error", MB_ICONERROR | MB_SYSTEMMODAL);
-#endif
+			m_crashedAt = std::chrono::steady_clock::now();
+			scheduleRestart();
+		}
+	}
+
+	return false;
+}
+
+void VSTPlugin::scheduleRestart()
+{
+	// The restart in progress counts its own failed attempts
+	if (m_restarting)
+		return;
+
+	// Set before unloadEffect on destruction, a block processed in between mustn't load the plug-in again
+	if (m_destroying)
+		return;
+
+	m_restartRequested = true;
+	m_controlWakeup.post();
+}
+
+void VSTPlugin::cancelRestart()
+{
+	std::unique_lock<std::mutex> lck(m_restartMutex);
 
+	m_restartRequested = false;
+	m_restartStop = true;
+	m_restartCondition.notify_all();
+
+	// The attempt in progress holds the effect until it's done, after that it can't load behind our back
+	m_restartCondition.wait(lck, [this] { return !m_restarting; });
+	m_restartStop = false;
+}
+
+void VSTPlugin::beginDestroy()
+{
+	m_destroying = true;
+	cancelRestart();
+}
+
+void VSTPlugin::runControl()
+{
+	for (;;) {
+		m_controlWakeup.wait();
+
+		if (m_controlStop)
+			return;
+
+		if (m_restartRequested.exchange(false))
+			restartProxy();
+
+		const uint32_t blockSize = m_requestedBlockSize.exchange(0);
+
+		if (blockSize != 0)
+			setBlockSize(blockSize);
+
+		if (m_chainRequested.exchange(false))
+			updateChain();
+
+		if (m_effectRefreshRequested.exchange(false))
+			refreshEffect();
+
+		if (m_latencyChanged.exchange(false))
+			publishLatency();
+	}
+}
+
+void VSTPlugin::restartProxy()
+{
+	{
+		std::lock_guard<std::mutex> grd(m_restartMutex);
+
+		if (m_restartStop)
+			return;
+
+		m_restarting = true;
+	}
+
+	for (int attempt = 1; attempt <= MaxRestartAttempts; attempt++) {
+		{
+			std::unique_lock<std::mutex> lck(m_restartMutex);
+
+			if (m_restartCondition.wait_for(lck, std::chrono::milliseconds(RestartBackoffMs * (attempt - 1)), [this] { return m_restartStop; }))
+				break;
+		}
+
+		// Audio passes through while this holds the effect, process() only tries the lock
+		std::lock_guard<std::recursive_mutex> grd(m_effectStatusMutex);
+
+		// Unloaded or reloaded since the crash was noticed, or the filter is going away
+		if (!m_proxyDisconnected || m_destroying)
+			break;
+
+		// Stopping the proxy drops the mirror, the restart sets these values again
+		{
+			std::lock_guard<std::mutex> parameterGrd(m_parameterMutex);
+
+			if (m_parametersMirrored) {
+				std::lock_guard<std::mutex> restoreGrd(m_restoreMutex);
+				m_restoreParameters = m_parameters;
+			}
+		}
+
+		// The crashed proxy, or what the previous attempt left of its own
+		stopProxy();
+
+		m_proxyDisconnected = false;
+		loadEffectFromPath(m_pluginPath);
+
+		if (verifyProxy()) {
+			restoreState();
+
+			if (verifyProxy()) {
+				const uint32_t elapsed =
+					uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_crashedAt).count());
+
+				m_restarts++;
+				m_lastRecoveryMs = elapsed;
+
+				blog(elapsed > RecoveryBudgetMs ? LOG_WARNING : LOG_INFO, "VST Plug-in: '%s' recovered in %u ms after %d attempt(s), %llu restart(s) so far",
+				     m_pluginPath.c_str(), elapsed, attempt, (unsigned long long)m_restarts.load());
+				break;
+			}
+		}
+
+		// A load that failed before it had an effect doesn't flag itself
+		m_proxyDisconnected = true;
+
+		blog(LOG_WARNING, "VST Plug-in: restart %d of %d failed for '%s'", attempt, MaxRestartAttempts, m_pluginPath.c_str());
+
+		if (attempt == MaxRestartAttempts) {
 			stopProxy();
-			return false;
-		} else {
-			return true;
+
+			// Disabled as before, recreating the filter or reloading the plug-in tries again
+			blog(LOG_ERROR, "VST Plug-in: '%s' could not be restarted, the filter is disabled", m_pluginPath.c_str());
 		}
 	}
 
-	return false;
+	std::lock_guard<std::mutex> grd(m_restartMutex);
+	m_restarting = false;
+	m_restartCondition.notify_all();
 }
 
-void silenceChannel(float **channelData, int numChannels, long numFrames)
+void VSTPlugin::rememberChunk(const VstChunkType type, const std::string &data)
 {
-	for (int channel = 0; channel < numChannels; ++channel) {
-		for (long frame = 0; frame < numFrames; ++frame) {
-			channelData[channel][frame] = 0.0f;
+	if (data.empty())
+		return;
+
+	std::lock_guard<std::mutex> grd(m_restoreMutex);
+	m_restoreChunks[type] = data;
+}
+
+void VSTPlugin::restoreState()
+{
+	std::string chunks[3];
+	std::vector<float> parameters;
+	int program;
+
+	{
+		std::lock_guard<std::mutex> grd(m_restoreMutex);
+
+		for (int i = 0; i < 3; i++)
+			chunks[i] = m_restoreChunks[i];
+
+		parameters = std::move(m_restoreParameters);
+		program = m_restoreProgram;
+	}
+
+	if (program >= 0)
+		setProgram(program);
+
+	// Same order as loading the filter's settings
+	setChunk(VstChunkType::Parameter, chunks[VstChunkType::Parameter]);
+	setChunk(VstChunkType::Program, chunks[VstChunkType::Program]);
+	setChunk(VstChunkType::Bank, chunks[VstChunkType::Bank]);
+
+	// The mirror was more recent than any saved chunk
+	if (m_effect != nullptr && !(m_effect->flags & effFlagsProgramChunks) && parameters.size() == size_t(m_effect->numParams)) {
+		for (int i = 0; i < m_effect->numParams; i++)
+			m_remote->setParameter(m_effect.get(), i, parameters[i]);
+	}
+
+	if (m_is_open && !m_windowCreated)
+		openEditor();
+}
+
+void VSTPlugin::onEffectChanged(const AEffect &previous, const AEffect &current)
+{
+	blog(LOG_INFO, "VST Plug-in: '%s' changed I/O from %d in/%d out to %d in/%d out, latency from %d to %d samples", m_pluginPath.c_str(),
+	     previous.numInputs, previous.numOutputs, current.numInputs, current.numOutputs, previous.initialDelay, current.initialDelay);
+
+	if (previous.initialDelay != current.initialDelay)
+		updateLatency();
+}
+
+void VSTPlugin::onParametersChanged(const int numParams, const int *indices, const float *values, const int count)
+{
+	std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+	if (m_parameters.size() != size_t(numParams))
+		m_parameters.assign(numParams, 0.0f);
+
+	for (int i = 0; i < count; i++) {
+		if (indices[i] >= 0 && indices[i] < numParams)
+			m_parameters[indices[i]] = values[i];
+	}
+
+	m_parametersMirrored = true;
+}
+
+float VSTPlugin::getParameter(const int index)
+{
+	{
+		std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+		if (m_parametersMirrored && m_effect != nullptr && m_parameters.size() == size_t(m_effect->numParams)) {
+			if (index < 0 || size_t(index) >= m_parameters.size())
+				return 0.0f;
+
+			return m_parameters[index];
 		}
 	}
+
+	if (m_effect == nullptr || m_remote == nullptr)
+		return 0.0f;
+
+	return m_remote->getParameter(m_effect.get(), index);
 }
 
 obs_audio_data *VSTPlugin::process(struct obs_audio_data *audio)
@@ -167,43 +394,784 @@ obs_audio_data *VSTPlugin::process(struct obs_audio_data *audio)
 	if (!m_effectStatusMutex.try_lock())
 		return audio;
 
+	// Added to a source or moved to another one, the control thread watches its filters from now on
+	obs_source_t *parent = obs_filter_get_parent(m_sourceContext);
+
+	if (parent != m_seenParent) {
+		m_seenParent = parent;
+		requestChainUpdate();
+	}
+
+	if (m_chainRefused && ++m_chainRetryTicks >= ChainRetryTicks) {
+		m_chainRetryTicks = 0;
+		requestChainUpdate();
+	}
+
+	// A filter before us in the chain already ran our plug-in on this audio
+	if (m_chainedAt->load() == audio->timestamp) {
+		if (m_pipelineActive)
+			resetPipeline(false, 0);
+
+		if (m_reblockActive)
+			resetReblock(false);
+
+		m_effectStatusMutex.unlock();
+		return audio;
+	}
+
 	if (m_effect != nullptr && m_remote != nullptr) {
-		uint32_t passes = (audio->frames + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		uint32_t extra = audio->frames % BLOCK_SIZE;
+		// The output mix's layout, every source is converted to it before the filters see it
+		int channels = std::min(int(audio_output_get_channels(obs_get_audio())), VST_MAX_CHANNELS);
+
+		while (channels > 0 && audio->data[channels - 1] == nullptr)
+			channels--;
+
+		// Only ship the channels the routing reads or writes
+		updateRouting(channels);
+
+		if (m_routing.rows == 0) {
+			m_effectStatusMutex.unlock();
+			return audio;
+		}
+
+		float *rows[VST_MAX_CHANNELS];
+
+		for (int r = 0; r < m_routing.rows; r++)
+			rows[r] = (float *)audio->data[m_routing.rowChannel[r]];
+
+		const uint32_t sampleRate = audio_output_get_sample_rate(obs_get_audio());
+
+		// Quiet for the whole tail, so the plug-in has nothing left to say. The first loud block goes out right away
+		const bool muted = m_silenceGate && sourceMuted();
+		const bool inputSilent = m_silenceGate && (muted || AudioKernels::isSilent(rows, m_routing.rows, audio->frames, SilenceThreshold));
+
+		if (inputSilent && m_quietFrames >= uint64_t(m_silenceTailMs) * sampleRate / 1000) {
+			if (!m_gated)
+				blog(LOG_DEBUG, "VST Plug-in: '%s' is silent, pausing", m_pluginPath.c_str());
+
+			m_gated = true;
+			m_effectStatusMutex.unlock();
+			return audio;
+		}
+
+		m_gated = false;
+
+		// A gated head leaves its stages to run on their own, it claims them again here. The routing above covers the chain's outputs
+		const uint32_t claims = m_chainClaimCount;
+
+		for (uint32_t s = 0; s < claims; s++)
+			m_chainClaims[s]->store(audio->timestamp);
+
+		const uint32_t blockSize = m_blockSize;
+		uint32_t passes = (audio->frames + blockSize - 1) / blockSize;
+		uint32_t extra = audio->frames % blockSize;
+
+		// Needs a transport that can have blocks in flight, and room for every block of this call
+		const bool pipelined = m_pipelined && m_remote->canPipeline() && passes <= grpc_vst_communicatorClient::MaxPendingBlocks;
+
+		// Filled again at the new size after an adaptive change
+		const bool reblock = m_reblocking && !pipelined;
+
+		if (pipelined != m_pipelineActive)
+			resetPipeline(pipelined, audio->frames);
+
+		if (reblock != m_reblockActive || (reblock && m_reblockSize != blockSize))
+			resetReblock(reblock);
+
+		// Scaled from the duration of a full block so the last, shorter pass gets the same allowance
+		const double blockMs = sampleRate > 0 ? blockSize * 1000.0 / sampleRate : 0.0;
+		m_remote->setBlockDeadline(std::max(uint32_t(blockMs * m_deadlineBlocks + 0.5), 1u));
+
+		if (pipelined) {
+			processPipelined(rows, audio->frames);
+			trackSilence(rows, audio->frames, inputSilent, muted);
+			m_effectStatusMutex.unlock();
+			return audio;
+		}
+
+		if (reblock) {
+			processReblocked(rows, audio->frames);
+			trackSilence(rows, audio->frames, inputSilent, muted);
+			m_effectStatusMutex.unlock();
+			return audio;
+		}
 
 		for (uint32_t pass = 0; pass < passes; pass++) {
-			uint32_t frames = pass == passes - 1 && extra ? extra : BLOCK_SIZE;
-			silenceChannel(m_outputs, VST_MAX_CHANNELS, BLOCK_SIZE);
+			uint32_t frames = pass == passes - 1 && extra ? extra : blockSize;
 
 			float *adata[VST_MAX_CHANNELS];
+			float *inputs[VST_MAX_CHANNELS];
+
+			for (int r = 0; r < m_routing.rows; r++)
+				adata[r] = rows[r] + (pass * blockSize);
 
-			for (size_t d = 0; d < VST_MAX_CHANNELS; d++) {
-				if (audio->data[d] != nullptr)
-					adata[d] = ((float *)audio->data[d]) + (pass * BLOCK_SIZE);
-				else
-					adata[d] = m_inputs[d];
-			};
+			gatherInputs(adata, inputs);
 
-			m_remote->processReplacing(m_effect.get(), adata, m_outputs, frames, VST_MAX_CHANNELS);
+			const auto callStart = std::chrono::steady_clock::now();
+			const bool received = m_remote->processReplacing(m_effect.get(), inputs, m_routing.inputs, blockOutputs(frames), m_routing.outputs, frames);
+
+			// Only full blocks that made it say how long a block of this size takes
+			if (received && frames == blockSize)
+				adaptBlockSize(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - callStart).count());
 
 			if (!verifyProxy(true)) {
 				m_effectStatusMutex.unlock();
 				return audio;
 			}
 
-			for (size_t c = 0; c < VST_MAX_CHANNELS; c++) {
-				if (audio->data[c] != nullptr) {
-					for (size_t i = 0; i < frames; i++)
-						adata[c][i] = m_outputs[c][i];
-				}
-			}
+			routeOutputs(adata, frames);
+			coverBlock(adata, m_routing.rows, frames, received);
+
+			AudioKernels::copyPlanes(adata, m_outputs, m_routing.rows, frames);
 		}
+
+		trackSilence(rows, audio->frames, inputSilent, muted);
 	}
 
 	m_effectStatusMutex.unlock();
 	return audio;
 }
 
+void VSTPlugin::setChannelRouting(const std::string &inputs, const std::string &outputs)
+{
+	ChannelMap inputMap;
+	ChannelMap outputMap;
+
+	if (!ChannelRoutings::parse(inputs, inputMap))
+		blog(LOG_WARNING, "VST Plug-in: input routing '%s' is malformed, routing automatically", inputs.c_str());
+
+	if (!ChannelRoutings::parse(outputs, outputMap))
+		blog(LOG_WARNING, "VST Plug-in: output routing '%s' is malformed, routing automatically", outputs.c_str());
+
+	{
+		std::lock_guard<std::mutex> grd(m_routingMutex);
+		m_inputMap = inputMap;
+		m_outputMap = outputMap;
+		m_routingAutomatic = inputMap.automatic() && outputMap.automatic();
+		m_routingChanged = true;
+	}
+
+	// Only automatically routed filters are chained
+	requestChainUpdates();
+}
+
+void VSTPlugin::updateRouting(const int channels)
+{
+	if (m_routingChanged.exchange(false)) {
+		std::lock_guard<std::mutex> grd(m_routingMutex);
+		m_activeInputMap = m_inputMap;
+		m_activeOutputMap = m_outputMap;
+	}
+
+	const int outputs = std::max(m_effect->numOutputs, m_chainOutputs.load());
+	const ChannelRouting routing = ChannelRoutings::resolve(m_activeInputMap, m_activeOutputMap, channels, m_effect->numInputs, outputs);
+
+	if (routing == m_routing)
+		return;
+
+	// Blocks in flight and half filled blocks are laid out by row, they start over at the new size
+	if (m_pipelineActive)
+		resetPipeline(false, 0);
+
+	if (m_reblockActive)
+		resetReblock(false);
+
+	// Sized for every channel in the constructor, a new routing only clears the rows it uses
+	m_routing = routing;
+	memset(m_outputData.data(), 0, size_t(routing.rows) * MAX_BLOCK_SIZE * sizeof(float));
+	memset(m_pluginOutputData.data(), 0, size_t(routing.outputs) * MAX_BLOCK_SIZE * sizeof(float));
+
+	m_lastBlockFrames = 0;
+	m_lastBlockMissed = false;
+
+	blog(LOG_INFO, "VST Plug-in: '%s' uses %d of %d channels, %d plug-in inputs and %d outputs%s", m_pluginPath.c_str(), routing.rows, channels,
+	     routing.inputs, routing.outputs, routing.direct ? "" : ", routed");
+}
+
+void VSTPlugin::gatherInputs(float **dry, float **inputs)
+{
+	for (int i = 0; i < m_routing.inputs; i++)
+		inputs[i] = m_routing.inputRow[i] >= 0 ? dry[m_routing.inputRow[i]] : m_silence.data();
+}
+
+float **VSTPlugin::blockOutputs(const uint32_t frames)
+{
+	// Rows the plug-in has no output for are silenced, as before
+	if (m_routing.direct) {
+		AudioKernels::zeroPlanes(m_outputs, m_routing.rows, frames);
+		return m_outputs;
+	}
+
+	AudioKernels::zeroPlanes(m_pluginOutputs, m_routing.outputs, frames);
+	return m_pluginOutputs;
+}
+
+void VSTPlugin::routeOutputs(float **dry, const uint32_t frames)
+{
+	if (m_routing.direct)
+		return;
+
+	for (int r = 0; r < m_routing.rows; r++) {
+		const int8_t output = m_routing.rowOutput[r];
+
+		if (output >= 0)
+			memcpy(m_outputs[r], m_pluginOutputs[output], frames * sizeof(float));
+		else if (output == ChannelRouting::Dry)
+			memcpy(m_outputs[r], dry[r], frames * sizeof(float));
+		else
+			memset(m_outputs[r], 0, frames * sizeof(float));
+	}
+}
+
+void VSTPlugin::trackSilence(float **rows, const uint32_t frames, const bool inputSilent, const bool muted)
+{
+	// Muted output isn't heard, only its tail length counts then
+	if (inputSilent && (muted || AudioKernels::isSilent(rows, m_routing.rows, frames, SilenceThreshold)))
+		m_quietFrames += frames;
+	else
+		m_quietFrames = 0;
+}
+
+bool VSTPlugin::sourceMuted() const
+{
+	obs_source_t *parent = obs_filter_get_parent(m_sourceContext);
+	return parent != nullptr && obs_source_muted(parent);
+}
+
+void VSTPlugin::updateChain()
+{
+	watchParent();
+
+	std::lock_guard<std::recursive_mutex> grd(m_effectStatusMutex);
+
+	if (m_effect == nullptr || m_remote == nullptr || m_proxyDisconnected)
+		return;
+
+	obs_source_t *parent = obs_filter_get_parent(m_sourceContext);
+
+	ChainScan scan = {};
+	scan.head = this;
+	scan.open = true;
+
+	// Enumerates in processing order under the parent's filter mutex, the filter list can't change meanwhile
+	if (parent != nullptr)
+		obs_source_enum_filters(parent, enumChainStage, &scan);
+
+	const bool changed = scan.count != m_chainCount || memcmp(scan.stages, m_chainStages, scan.count * sizeof(uint32_t)) != 0;
+
+	if (changed || m_chainRefused) {
+		memcpy(m_chainStages, scan.stages, scan.count * sizeof(uint32_t));
+		m_chainCount = scan.count;
+		m_chained = m_remote->setChain(scan.stages, scan.count) && scan.count > 0;
+
+		if (scan.count > 0 && (changed || m_chained))
+			blog(LOG_INFO, "VST Plug-in: '%s' %s %u following filters in its blocks", m_pluginPath.c_str(), m_chained ? "runs" : "can't run",
+			     scan.count);
+	}
+
+	m_chainRefused = scan.count > 0 && !m_chained;
+
+	// The audio thread can't be in process() while the effect mutex is held, it picks these up on its next tick
+	const uint32_t claims = m_chained ? scan.count : 0;
+
+	for (uint32_t s = 0; s < claims; s++)
+		m_chainClaims[s] = scan.claims[s];
+
+	m_chainClaimCount = claims;
+	m_chainOutputs = m_chained ? scan.outputs : 0;
+}
+
+void VSTPlugin::enumChainStage(obs_source_t * /*parent*/, obs_source_t *filter, void *param)
+{
+	ChainScan &scan = *static_cast<ChainScan *>(param);
+
+	if (!scan.open)
+		return;
+
+	if (!scan.started) {
+		scan.started = filter == scan.head->m_sourceContext;
+		return;
+	}
+
+	// Disabled filters are skipped by OBS, so they don't break the run
+	if (!obs_source_enabled(filter))
+		return;
+
+	VSTPlugin *next = strcmp(obs_source_get_id(filter), "vst_filter") == 0 ? static_cast<VSTPlugin *>(obs_obj_get_data(filter)) : nullptr;
+
+	if (next == nullptr) {
+		scan.open = false;
+		return;
+	}
+
+	scan.open = scan.count < MaxChainStages && scan.head->addChainStage(*next, scan);
+}
+
+bool VSTPlugin::addChainStage(VSTPlugin &next, ChainScan &scan)
+{
+	// Never wait on a filter that is loading or unloading, the chain ends before it for now
+	if (!next.m_effectStatusMutex.try_lock())
+		return false;
+
+	// A stage runs on our blocks, which must not be longer than the block size it was told. The head's routing covers the
+	// whole chain, so only automatically routed filters take part
+	const bool chainable = next.m_effect != nullptr && next.m_remote != nullptr && !next.m_proxyDisconnected && sharesProxyWith(next) &&
+			       next.m_blockSize >= m_blockSize && m_routingAutomatic && next.m_routingAutomatic;
+
+	if (chainable) {
+		scan.claims[scan.count] = next.m_chainedAt;
+		scan.stages[scan.count++] = next.m_remote->instance();
+		scan.outputs = std::max(scan.outputs, next.m_effect->numOutputs);
+	}
+
+	next.m_effectStatusMutex.unlock();
+	return chainable;
+}
+
+void VSTPlugin::requestChainUpdate()
+{
+	m_chainRequested = true;
+	m_controlWakeup.post();
+}
+
+void VSTPlugin::requestChainUpdates()
+{
+	obs_source_t *parent = obs_filter_get_parent(m_sourceContext);
+
+	if (parent == nullptr) {
+		requestChainUpdate();
+		return;
+	}
+
+	// Any VST filter of the source may be the head of a chain this one is in or could join, each scans on its own control thread
+	obs_source_enum_filters(
+		parent,
+		[](obs_source_t * /*parent*/, obs_source_t *filter, void * /*param*/) {
+			VSTPlugin *plugin = strcmp(obs_source_get_id(filter), "vst_filter") == 0 ? static_cast<VSTPlugin *>(obs_obj_get_data(filter))
+												 : nullptr;
+
+			if (plugin != nullptr)
+				plugin->requestChainUpdate();
+		},
+		nullptr);
+}
+
+void VSTPlugin::watchParent()
+{
+	obs_source_t *parent = obs_filter_get_parent(m_sourceContext);
+
+	std::lock_guard<std::mutex> grd(m_watchMutex);
+	obs_source_t *watched = obs_weak_source_get_source(m_watchedParent);
+
+	if (watched != parent) {
+		if (watched != nullptr) {
+			signal_handler_t *signals = obs_source_get_signal_handler(watched);
+			signal_handler_disconnect(signals, "filter_add", onFiltersChanged, this);
+			signal_handler_disconnect(signals, "filter_remove", onFiltersChanged, this);
+			signal_handler_disconnect(signals, "reorder_filters", onFiltersChanged, this);
+		}
+
+		obs_weak_source_release(m_watchedParent);
+		m_watchedParent = nullptr;
+
+		if (parent != nullptr) {
+			signal_handler_t *signals = obs_source_get_signal_handler(parent);
+			signal_handler_connect(signals, "filter_add", onFiltersChanged, this);
+			signal_handler_connect(signals, "filter_remove", onFiltersChanged, this);
+			signal_handler_connect(signals, "reorder_filters", onFiltersChanged, this);
+			m_watchedParent = obs_source_get_weak_source(parent);
+		}
+	}
+
+	obs_source_release(watched);
+}
+
+void VSTPlugin::unwatchParent()
+{
+	std::lock_guard<std::mutex> grd(m_watchMutex);
+
+	// A source that is already gone took its signals with it
+	obs_source_t *watched = obs_weak_source_get_source(m_watchedParent);
+
+	if (watched != nullptr) {
+		signal_handler_t *signals = obs_source_get_signal_handler(watched);
+		signal_handler_disconnect(signals, "filter_add", onFiltersChanged, this);
+		signal_handler_disconnect(signals, "filter_remove", onFiltersChanged, this);
+		signal_handler_disconnect(signals, "reorder_filters", onFiltersChanged, this);
+		obs_source_release(watched);
+	}
+
+	obs_weak_source_release(m_watchedParent);
+	m_watchedParent = nullptr;
+
+	// Added back later, the audio thread takes it for a new parent
+	m_seenParent = nullptr;
+}
+
+void VSTPlugin::onFiltersChanged(void *data, calldata_t * /*cd*/)
+{
+	static_cast<VSTPlugin *>(data)->requestChainUpdate();
+}
+
+void VSTPlugin::onEnabledChanged(void *data, calldata_t * /*cd*/)
+{
+	static_cast<VSTPlugin *>(data)->requestChainUpdates();
+}
+
+void VSTPlugin::processPipelined(float **rows, const uint32_t frames)
+{
+	// Results of the previous call's blocks, the proxy had a whole audio tick to produce them
+	while (m_inFlightCount > 0) {
+		const PipelinedBlock block = m_inFlight[m_inFlightHead];
+		float *dry[VST_MAX_CHANNELS];
+
+		for (int r = 0; r < block.numChannels; r++)
+			dry[r] = inFlightInput(m_inFlightHead, r);
+
+		m_inFlightHead = (m_inFlightHead + 1) % m_inFlight.size();
+		m_inFlightCount--;
+
+		int outputs = 0;
+		int blockFrames = 0;
+		const bool received = block.submitted && m_remote->collectBlock(m_effect.get(), blockOutputs(block.frames), outputs, blockFrames);
+
+		if (!verifyProxy(true))
+			return;
+
+		routeOutputs(dry, block.frames);
+		coverBlock(dry, block.numChannels, block.frames, received);
+		pushDelayed(m_outputs, block.numChannels, block.frames);
+	}
+
+	const uint32_t blockSize = m_blockSize;
+	uint32_t passes = (frames + blockSize - 1) / blockSize;
+	uint32_t extra = frames % blockSize;
+
+	// Submitting copies the input, so the source buffers are free to take the delayed output
+	for (uint32_t pass = 0; pass < passes; pass++) {
+		uint32_t passFrames = pass == passes - 1 && extra ? extra : blockSize;
+		const uint32_t slot = (m_inFlightHead + m_inFlightCount) % m_inFlight.size();
+
+		float *adata[VST_MAX_CHANNELS];
+		float *inputs[VST_MAX_CHANNELS];
+
+		for (int r = 0; r < m_routing.rows; r++) {
+			adata[r] = rows[r] + (pass * blockSize);
+			memcpy(inFlightInput(slot, r), adata[r], passFrames * sizeof(float));
+		}
+
+		gatherInputs(adata, inputs);
+
+		PipelinedBlock &block = m_inFlight[slot];
+		block.frames = passFrames;
+		block.numChannels = m_routing.rows;
+		block.submitted = m_remote->submitBlock(m_effect.get(), inputs, m_routing.inputs, m_routing.outputs, passFrames);
+		m_inFlightCount++;
+
+		if (!block.submitted && !verifyProxy(true))
+			return;
+	}
+
+	const uint32_t available = std::min(m_delayFill, frames);
+
+	for (int r = 0; r < m_routing.rows; r++) {
+		float *data = rows[r];
+		const float *line = &m_delayLine[size_t(r) * m_delayCapacity];
+
+		for (uint32_t i = 0; i < available; i++)
+			data[i] = line[(m_delayRead + i) % m_delayCapacity];
+
+		// Only the first call after enabling runs short, that silence is the added latency
+		memset(data + available, 0, (frames - available) * sizeof(float));
+	}
+
+	m_delayRead = (m_delayRead + available) % m_delayCapacity;
+	m_delayFill -= available;
+}
+
+void VSTPlugin::coverBlock(float **dry, const int numChannels, const uint32_t frames, const bool received)
+{
+	if (received) {
+		// A plug-in that blew up must not take the encoder with it
+		const uint32_t nonFinite = AudioKernels::sanitizePlanes(m_outputs, numChannels, frames);
+
+		if (nonFinite > 0) {
+			const uint64_t blocks = ++m_sanitizedBlocks;
+
+			if (blocks == 1 || blocks % 100 == 0)
+				blog(LOG_WARNING, "VST Plug-in: '%s' produced %u NaN or infinite samples, silenced, %llu blocks so far", m_pluginPath.c_str(),
+				     nonFinite, (unsigned long long)blocks);
+		}
+
+		// Fade back in from the dry signal after a miss
+		if (m_lastBlockMissed) {
+			for (int c = 0; c < numChannels; c++)
+				AudioKernels::crossfade(m_outputs[c], dry[c], m_outputs[c], frames);
+		}
+
+		for (int c = 0; c < numChannels; c++)
+			memcpy(&m_lastBlock[size_t(c) * MAX_BLOCK_SIZE], m_outputs[c], frames * sizeof(float));
+
+		m_lastBlockFrames = frames;
+		m_lastBlockMissed = false;
+		return;
+	}
+
+	const uint64_t xruns = ++m_xruns;
+
+	if (xruns == 1 || xruns % 100 == 0)
+		blog(LOG_WARNING, "VST Plug-in: '%s' missed its block deadline, %llu blocks played dry so far", m_pluginPath.c_str(),
+		     (unsigned long long)xruns);
+
+	if (!m_lastBlockMissed && m_lastBlockFrames > 0) {
+		// Repeat the last processed block while it fades out under the dry signal
+		for (int c = 0; c < numChannels; c++) {
+			const float *wet = &m_lastBlock[size_t(c) * MAX_BLOCK_SIZE];
+
+			if (m_lastBlockFrames >= frames) {
+				AudioKernels::crossfade(m_outputs[c], wet, dry[c], frames);
+				continue;
+			}
+
+			// A shorter last block repeats
+			for (uint32_t i = 0; i < frames; i++) {
+				const float gain = float(i) / frames;
+				m_outputs[c][i] = wet[i % m_lastBlockFrames] * (1.0f - gain) + dry[c][i] * gain;
+			}
+		}
+	} else {
+		AudioKernels::copyPlanes(m_outputs, dry, numChannels, frames);
+	}
+
+	m_lastBlockMissed = true;
+}
+
+void VSTPlugin::pushDelayed(float **outputs, const int numOutputs, const uint32_t frames)
+{
+	// Overflow only happens if call sizes jump, keep the newest audio
+	if (m_delayFill + frames > m_delayCapacity) {
+		const uint32_t drop = std::min(m_delayFill, m_delayFill + frames - m_delayCapacity);
+		m_delayRead = (m_delayRead + drop) % m_delayCapacity;
+		m_delayFill -= drop;
+	}
+
+	const uint32_t write = (m_delayRead + m_delayFill) % m_delayCapacity;
+
+	for (int c = 0; c < m_routing.rows; c++) {
+		float *line = &m_delayLine[size_t(c) * m_delayCapacity];
+
+		for (uint32_t i = 0; i < frames; i++)
+			line[(write + i) % m_delayCapacity] = c < numOutputs ? outputs[c][i] : 0.0f;
+	}
+
+	m_delayFill = std::min(m_delayFill + frames, m_delayCapacity);
+}
+
+void VSTPlugin::resetPipeline(const bool active, const uint32_t frames)
+{
+	m_pipelineActive = active;
+	m_delayRead = 0;
+	m_delayFill = 0;
+
+	m_inFlightHead = 0;
+	m_inFlightCount = 0;
+
+	setLatency(active ? frames : m_reblockActive ? m_reblockSize : 0);
+}
+
+void VSTPlugin::processReblocked(float **rows, const uint32_t frames)
+{
+	const uint32_t blockSize = m_reblockSize;
+
+	// At most a block per slice, so neither side ever holds more than two blocks
+	for (uint32_t offset = 0; offset < frames;) {
+		const uint32_t slice = std::min(blockSize, frames - offset);
+
+		for (int r = 0; r < m_routing.rows; r++)
+			memcpy(reblockInput(r) + m_reblockInputFill, rows[r] + offset, slice * sizeof(float));
+
+		m_reblockInputFill += slice;
+
+		if (m_reblockInputFill >= blockSize) {
+			float *dry[VST_MAX_CHANNELS];
+			float *inputs[VST_MAX_CHANNELS];
+
+			for (int r = 0; r < m_routing.rows; r++)
+				dry[r] = reblockInput(r);
+
+			gatherInputs(dry, inputs);
+
+			const auto callStart = std::chrono::steady_clock::now();
+			const bool received = m_remote->processReplacing(m_effect.get(), inputs, m_routing.inputs, blockOutputs(blockSize), m_routing.outputs, blockSize);
+
+			if (received)
+				adaptBlockSize(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - callStart).count());
+
+			if (!verifyProxy(true))
+				return;
+
+			routeOutputs(dry, blockSize);
+			coverBlock(dry, m_routing.rows, blockSize, received);
+
+			m_reblockInputFill -= blockSize;
+
+			for (int r = 0; r < m_routing.rows; r++) {
+				memcpy(reblockOutput(r) + m_reblockOutputFill, m_outputs[r], blockSize * sizeof(float));
+				memmove(reblockInput(r), reblockInput(r) + blockSize, m_reblockInputFill * sizeof(float));
+			}
+
+			m_reblockOutputFill += blockSize;
+		}
+
+		// The block of silence queued at the start keeps this from ever running dry
+		m_reblockOutputFill -= slice;
+
+		for (int r = 0; r < m_routing.rows; r++) {
+			memcpy(rows[r] + offset, reblockOutput(r), slice * sizeof(float));
+			memmove(reblockOutput(r), reblockOutput(r) + slice, m_reblockOutputFill * sizeof(float));
+		}
+
+		offset += slice;
+	}
+}
+
+void VSTPlugin::resetReblock(const bool active)
+{
+	m_reblockActive = active;
+	m_reblockSize = active ? uint32_t(m_blockSize) : 0;
+	m_reblockInputFill = 0;
+
+	// One block of silence ahead of the first result, that is the added latency. Only that much of each row is read before it's written
+	m_reblockOutputFill = m_reblockSize;
+
+	for (int r = 0; active && r < m_routing.rows; r++)
+		memset(reblockOutput(r), 0, m_reblockSize * sizeof(float));
+
+	setLatency(active ? m_reblockSize : m_pipelineActive ? m_latencyFrames.load() : 0);
+}
+
+void VSTPlugin::setLatency(const uint32_t frames)
+{
+	if (frames != m_latencyFrames)
+		blog(LOG_INFO, "VST Plug-in: '%s' latency is now %u frames", m_pluginPath.c_str(), frames);
+
+	m_latencyFrames = frames;
+	updateLatency();
+}
+
+void VSTPlugin::updateLatency()
+{
+	const AEffect *effect = m_effect.get();
+	const uint32_t pluginFrames = effect != nullptr && effect->initialDelay > 0 ? uint32_t(effect->initialDelay) : 0;
+	const uint32_t frames = pluginFrames + m_latencyFrames;
+
+	m_pluginLatencyFrames = pluginFrames;
+
+	if (frames == m_totalLatencyFrames.exchange(frames))
+		return;
+
+	// Mostly the audio thread gets here, signal handlers may take any lock or call back into OBS so the control thread emits it
+	m_latencyChanged = true;
+	m_controlWakeup.post();
+}
+
+void VSTPlugin::publishLatency()
+{
+	const uint32_t frames = m_totalLatencyFrames;
+	const uint32_t pluginFrames = m_pluginLatencyFrames;
+	const uint32_t sampleRate = audio_output_get_sample_rate(obs_get_audio());
+	const long long latencyNs = sampleRate > 0 ? (long long)(uint64_t(frames) * 1000000000ULL / sampleRate) : 0;
+
+	blog(LOG_INFO, "VST Plug-in: '%s' total latency is now %u frames (%u from the plug-in), %.2f ms", m_pluginPath.c_str(), frames, pluginFrames,
+	     latencyNs / 1000000.0);
+
+	uint8_t stack[128];
+	calldata_t cd;
+	calldata_init_fixed(&cd, stack, sizeof(stack));
+	calldata_set_ptr(&cd, "source", m_sourceContext);
+	calldata_set_int(&cd, "frames", frames);
+	calldata_set_int(&cd, "latency_ns", latencyNs);
+	signal_handler_signal(obs_source_get_signal_handler(m_sourceContext), "latency_changed", &cd);
+}
+
+void VSTPlugin::getLatencyProc(void *data, calldata_t *cd)
+{
+	VSTPlugin *plugin = static_cast<VSTPlugin *>(data);
+	const uint32_t frames = plugin->m_totalLatencyFrames;
+	const uint32_t sampleRate = audio_output_get_sample_rate(obs_get_audio());
+
+	calldata_set_int(cd, "frames", frames);
+	calldata_set_int(cd, "latency_ns", sampleRate > 0 ? (long long)(uint64_t(frames) * 1000000000ULL / sampleRate) : 0);
+}
+
+void VSTPlugin::adaptBlockSize(const double callMs)
+{
+	if (!m_adaptiveBlocks)
+		return;
+
+	m_blockCallMs += callMs;
+
+	if (++m_blockCalls < BlockSizeWindow)
+		return;
+
+	const double averageMs = m_blockCallMs / m_blockCalls;
+	const double targetMs = m_blockTargetMs;
+	const uint32_t blockSize = m_blockSize;
+
+	m_blockCallMs = 0.0;
+	m_blockCalls = 0;
+
+	// Doubling at most doubles the time per block, the fixed per call overhead doesn't grow, so this errs on the small side
+	if (averageMs > targetMs && blockSize / 2 >= MIN_BLOCK_SIZE)
+		requestBlockSize(blockSize / 2);
+	else if (averageMs * 2.0 < targetMs * 0.75 && blockSize * 2 <= MAX_BLOCK_SIZE)
+		requestBlockSize(blockSize * 2);
+}
+
+void VSTPlugin::requestBlockSize(const uint32_t blockSize)
+{
+	// Three dispatcher round trips, far too slow for the audio thread. Blocks keep the current size until they're done
+	m_requestedBlockSize = blockSize;
+	m_controlWakeup.post();
+}
+
+void VSTPlugin::setBlockSize(const uint32_t blockSize)
+{
+	// The audio thread passes audio through while this holds the effect, the plug-in is suspended for most of it anyway
+	std::lock_guard<std::recursive_mutex> grd(m_effectStatusMutex);
+
+	if (m_effect == nullptr || m_remote == nullptr || m_proxyDisconnected || blockSize == m_blockSize)
+		return;
+
+	blog(LOG_INFO, "VST Plug-in: '%s' block size is now %u frames", m_pluginPath.c_str(), blockSize);
+
+	// Plug-ins only expect a new block size while suspended
+	m_remote->dispatcher(m_effect.get(), effMainsChanged, 0, 0, nullptr, 0, 0);
+	m_remote->dispatcher(m_effect.get(), effSetBlockSize, 0, blockSize, nullptr, 0.0f, 0);
+	m_remote->dispatcher(m_effect.get(), effMainsChanged, 0, 1, nullptr, 0, 0);
+
+	// A failed call leaves the restart to reset the size
+	if (!verifyProxy())
+		return;
+
+	m_blockSize = blockSize;
+
+	// Stages can't be given blocks longer than their own
+	requestChainUpdates();
+}
+
+void VSTPlugin::refreshEffect()
+{
+	// Blocks told us the plug-in's fields changed. The audio thread passes audio through for the round trip, as for the block size
+	std::lock_guard<std::recursive_mutex> grd(m_effectStatusMutex);
+
+	if (m_effect == nullptr || m_remote == nullptr || m_proxyDisconnected)
+		return;
+
+	m_remote->refreshAEffect(m_effect.get());
+	verifyProxy();
+}
+
 void VSTPlugin::unloadEffect()
 {
 	std::lock_guard<std::recursive_mutex> grd(m_effectStatusMutex);
@@ -211,6 +1179,20 @@ void VSTPlugin::unloadEffect()
 	m_windowCreated = false;
 	m_proxyDisconnected = false;
 
+	if (m_pipelineActive)
+		resetPipeline(false, 0);
+
+	if (m_reblockActive)
+		resetReblock(false);
+
+	// A new instance starts without a chain, and chains that ran this one end before it
+	m_chainCount = 0;
+	m_chained = false;
+	m_chainRefused = false;
+	m_chainClaimCount = 0;
+	m_chainOutputs = 0;
+	requestChainUpdates();
+
 	if (m_effect != nullptr && m_remote != nullptr) {
 		m_remote->dispatcher(m_effect.get(), effStopProcess, 0, 0, nullptr, 0, 0);
 		m_remote->dispatcher(m_effect.get(), effMainsChanged, 0, 0, nullptr, 0, 0);
@@ -218,6 +1200,7 @@ void VSTPlugin::unloadEffect()
 	}
 
 	stopProxy();
+	updateLatency();
 }
 
 bool VSTPlugin::isEditorOpen()
@@ -304,13 +1287,24 @@ std::string VSTPlugin::getChunk(VstChunkType type)
 
 		int blockEnd = cbase64_encode_block((const unsigned char *)buf, uint32_t(chunkSize), &encodedData[0], &encoder);
 		cbase64_encode_blockend(&encodedData[blockEnd], &encoder);
+		rememberChunk(type, encodedData);
 		return encodedData;
 	} else if (!(m_effect->flags & effFlagsProgramChunks) && type == VstChunkType::Parameter) {
 		std::vector<float> params;
 
-		for (int i = 0; i < m_effect->numParams; i++) {
-			float parameter = m_remote->getParameter(m_effect.get(), i);
-			params.push_back(parameter);
+		{
+			std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+			if (m_parametersMirrored && m_parameters.size() == size_t(m_effect->numParams))
+				params = m_parameters;
+		}
+
+		// Only ask the proxy one by one when the mirror isn't complete
+		if (params.empty()) {
+			for (int i = 0; i < m_effect->numParams; i++) {
+				float parameter = m_remote->getParameter(m_effect.get(), i);
+				params.push_back(parameter);
+			}
 		}
 
 		if (!verifyProxy())
@@ -324,6 +1318,7 @@ std::string VSTPlugin::getChunk(VstChunkType type)
 
 			int blockEnd = cbase64_encode_block((const unsigned char *)bytes, uint32_t(size), &encodedData[0], &encoder);
 			cbase64_encode_blockend(&encodedData[blockEnd], &encoder);
+			rememberChunk(type, encodedData);
 		} else {
 			blog(LOG_WARNING, "VST Plug-in: getChunk params.empty()");
 		}
@@ -352,6 +1347,8 @@ void VSTPlugin::setChunk(VstChunkType type, std::string &data)
 		return;
 	}
 
+	rememberChunk(type, data);
+
 	decodedData.resize(cbase64_calc_decoded_length(data.data(), uint32_t(data.size())));
 	cbase64_decode_block(data.data(), uint32_t(data.size()), (unsigned char *)&decodedData[0], &decoder);
 	data = "";
@@ -374,6 +1371,11 @@ void VSTPlugin::setChunk(VstChunkType type, std::string &data)
 
 		for (int i = 0; i < m_effect->numParams; i++)
 			m_remote->setParameter(m_effect.get(), i, params[i]);
+
+		std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+		if (m_parametersMirrored && m_parameters.size() == params.size())
+			m_parameters = params;
 	}
 
 	verifyProxy();
@@ -389,6 +1391,9 @@ void VSTPlugin::setProgram(const int programNumber)
 	if (programNumber < m_effect->numPrograms) {
 		intptr_t ret = m_remote->dispatcher(m_effect.get(), effSetProgram, 0, programNumber, nullptr, 0.0f, 0);
 		blog(LOG_ERROR, "VST Plug-in: setProgram get %lld from effSetProgram", ret);
+
+		std::lock_guard<std::mutex> grd(m_restoreMutex);
+		m_restoreProgram = programNumber;
 	} else {
 		blog(LOG_ERROR, "VST Plug-in: setProgram Failed to load program, number was outside possible program range.");
 	}
@@ -404,7 +1409,12 @@ int VSTPlugin::getProgram()
 	}
 
 	intptr_t ret = m_remote->dispatcher(m_effect.get(), effGetProgram, 0, 0, nullptr, 0.0f, 0);
-	verifyProxy();
+
+	if (verifyProxy()) {
+		std::lock_guard<std::mutex> grd(m_restoreMutex);
+		m_restoreProgram = static_cast<int>(ret);
+	}
+
 	return static_cast<int>(ret);
 }
 
@@ -419,3 +1429,147 @@ std::string VSTPlugin::getPluginPath()
 {
 	return m_pluginPath;
 }
+
+AEffect *VSTPlugin::loadEffect()
+{
+	m_effect = std::make_unique<AEffect>();
+	m_proxy = ProxyProcesses::join(m_proxyGroup);
+
+	const bool joined = m_proxy != nullptr;
+
+	if (!joined)
+		m_proxy = ProxyProcesses::takeSpare();
+
+	if (m_proxy != nullptr) {
+		blog(LOG_DEBUG, "VST Plug-in: loading '%s' into the %s proxy on port %d", m_pluginPath.c_str(), joined ? "shared" : "spare", m_proxy->port);
+
+		m_remote = std::make_unique<grpc_vst_communicatorClient>(m_proxy->channel, m_proxy->audioChannel);
+
+		// The proxy may be on its way out with its last instance, start a new one then
+		if (!m_remote->m_connected || !m_remote->createInstance(m_pluginPath)) {
+			blog(LOG_WARNING, "VST Plug-in: proxy on port %d refused '%s', starting a new one", m_proxy->port, m_pluginPath.c_str());
+			stopProxy();
+			m_effect = std::make_unique<AEffect>();
+		} else if (!joined) {
+			ProxyProcesses::publish(m_proxyGroup, m_proxy);
+		}
+	}
+
+	if (m_proxy == nullptr && !launchProxy())
+		return nullptr;
+
+	ProxyProcesses::warmSpare();
+
+	m_remote->m_effectChangedFunction = [this](const AEffect &previous, const AEffect &current) { onEffectChanged(previous, current); };
+	m_remote->m_effectStaleFunction = [this]() {
+		m_effectRefreshRequested = true;
+		m_controlWakeup.post();
+	};
+	m_remote->updateAEffect(m_effect.get());
+
+	if (!verifyProxy())
+		return nullptr;
+
+	// Audio goes through shared memory when available, gRPC stays the control channel
+	const std::string sharedAudioName = "obs-vst-" + std::to_string(ProxyProcesses::currentProcessId()) + "-" + std::to_string(m_proxy->port) + "-" +
+					    std::to_string(m_remote->instance());
+
+	m_remote->reserveAudioBuffers(MAX_BLOCK_SIZE, VST_MAX_CHANNELS);
+
+	// Parameter reads and saves come from this mirror instead of a call per parameter
+	m_remote->m_parametersChangedFunction = [this](int numParams, const int *indices, const float *values, int count) {
+		onParametersChanged(numParams, indices, values, count);
+	};
+
+	if (!m_remote->watchParameters())
+		blog(LOG_WARNING, "VST Plug-in: parameter mirror unavailable for '%s'", m_pluginPath.c_str());
+
+	// OBS_VST_AUDIO_TRANSPORT=socket puts blocks on an AF_UNIX socket instead, for comparing transports
+	const char *transport = getenv("OBS_VST_AUDIO_TRANSPORT");
+	bool attached = false;
+
+	if (transport != nullptr && strcmp(transport, "socket") == 0) {
+		const std::string socketPath = (std::filesystem::temp_directory_path() / (sharedAudioName + ".sock")).string();
+		attached = m_remote->attachSocketAudio(m_effect.get(), socketPath, MAX_BLOCK_SIZE);
+
+		if (!attached)
+			blog(LOG_WARNING, "VST Plug-in: socket audio unavailable for '%s'", m_pluginPath.c_str());
+	}
+
+	if (!attached && !m_remote->attachSharedAudio(m_effect.get(), sharedAudioName, MAX_BLOCK_SIZE, VST_MAX_CHANNELS)) {
+		blog(LOG_WARNING, "VST Plug-in: shared memory audio unavailable for '%s', using gRPC stream", m_pluginPath.c_str());
+
+		// One stream per filter for its whole lifetime, blocks reuse it instead of a call each
+		if (!m_remote->openAudioStream())
+			blog(LOG_WARNING, "VST Plug-in: audio stream unavailable for '%s', using unary calls", m_pluginPath.c_str());
+	}
+
+	if (!verifyProxy())
+		return nullptr;
+
+	return m_effect.get();
+}
+
+bool VSTPlugin::launchProxy()
+{
+	blog(LOG_DEBUG, "VST Plug-in: starting a proxy for '%s'", m_pluginPath.c_str());
+
+	std::shared_ptr<ProxyProcess> proxy = ProxyProcesses::start(m_pluginPath);
+
+	if (proxy == nullptr) {
+#ifdef WIN32
+		// A restart after a crash retries on its own, no popup for each attempt
+		if (!m_restarting)
+			::MessageBoxA(NULL,
+				      (std::filesystem::path(m_pluginPath).filename().string() +
+				       " failed to launch.\n\n You may restart the application or recreate the filter to try again.")
+					      .c_str(),
+				      "VST Filter Error", MB_ICONERROR | MB_TOPMOST);
+#endif
+
+		m_effect = nullptr;
+		return false;
+	}
+
+	proxy->users = 1;
+	ProxyProcesses::publish(m_proxyGroup, proxy);
+
+	m_proxy = proxy;
+	m_remote = std::make_unique<grpc_vst_communicatorClient>(proxy->channel, proxy->audioChannel);
+	return true;
+}
+
+bool VSTPlugin::sharesProxyWith(const VSTPlugin &other) const
+{
+	return m_proxy != nullptr && m_proxy == other.m_proxy;
+}
+
+void VSTPlugin::stopProxy()
+{
+	if (m_effect == nullptr)
+		return;
+
+	auto movedPtr = move(m_effect);
+
+	{
+		std::lock_guard<std::mutex> grd(m_parameterMutex);
+		m_parameters.clear();
+		m_parametersMirrored = false;
+	}
+
+	if (m_remote == nullptr || m_proxy == nullptr)
+		return;
+
+	auto proxy = move(m_proxy);
+
+	// Other filters still use this process, only our instance goes away
+	if (!ProxyProcesses::leave(proxy)) {
+		m_remote->closeInstance();
+		return;
+	}
+
+	m_remote->stopServer(movedPtr.get());
+
+	// Wait for graceful end in a thread, don't block here
+	ProxyProcesses::end(*proxy, m_proxyDisconnected ? 3000 : 0);
+}
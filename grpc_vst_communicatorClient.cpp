@@ -1,16 +1,33 @@
 #include "headers/grpc_vst_communicatorClient.h"
-#include "headers/StlBuffer.h"
+#include "headers/AudioKernels.h"
 
 #include <aeffectx.h>
+#include <algorithm>
+#include <chrono>
 
-grpc_vst_communicatorClient::grpc_vst_communicatorClient(std::shared_ptr<Channel> channel) : stub_(grpc_vst_communicator::NewStub(channel))
+grpc_vst_communicatorClient::grpc_vst_communicatorClient(std::shared_ptr<Channel> channel, std::shared_ptr<Channel> audioChannel, const uint32_t instance)
+	: stub_(grpc_vst_communicator::NewStub(channel)),
+	  m_audioStub(grpc_vst_communicator::NewStub(audioChannel != nullptr ? audioChannel : channel)),
+	  m_instance(instance)
 {
-	m_connected = channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(3));
+	const auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(3);
+	m_connected = channel->WaitForConnected(deadline);
+
+	// A proxy whose audio server didn't come up still takes blocks on the control connection
+	if (m_connected && audioChannel != nullptr && audioChannel != channel && !audioChannel->WaitForConnected(deadline))
+		m_audioStub = grpc_vst_communicator::NewStub(channel);
+}
+
+grpc_vst_communicatorClient::~grpc_vst_communicatorClient()
+{
+	stopWatchingParameters();
+	closeAudioStream();
 }
 
 intptr_t grpc_vst_communicatorClient::dispatcher(AEffect *a, int b, int c, intptr_t d, void *ptr, float f, size_t ptr_size)
 {
 	grpc_dispatcher_Request request;
+	request.set_generation(m_generation);
 	request.set_param1(b);
 	request.set_param2(c);
 	request.set_param3(d);
@@ -18,15 +35,12 @@ intptr_t grpc_vst_communicatorClient::dispatcher(AEffect *a, int b, int c, intpt
 	request.set_ptr_value(int64_t(ptr));
 	request.set_ptr_size(int32_t(ptr_size));
 
-	if (ptr_size > 0) {
-		std::string str;
-		str.resize(ptr_size);
-		memcpy(str.data(), ptr, ptr_size);
-		request.set_ptr_data(str);
-	}
+	if (ptr_size > 0)
+		request.mutable_ptr_data()->assign(static_cast<const char *>(ptr), ptr_size);
 
 	grpc_dispatcher_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_dispatcher(&context, request, &reply);
 
 	if (!status.ok())
@@ -50,15 +64,7 @@ intptr_t grpc_vst_communicatorClient::dispatcher(AEffect *a, int b, int c, intpt
 		}
 	}
 
-	a->magic = reply.magic();
-	a->numPrograms = reply.numprograms();
-	a->numParams = reply.numparams();
-	a->numInputs = reply.numinputs();
-	a->numOutputs = reply.numoutputs();
-	a->flags = reply.flags();
-	a->initialDelay = reply.initialdelay();
-	a->uniqueID = reply.uniqueid();
-	a->version = reply.version();
+	applyAEffect(a, reply);
 
 	return reply.returnval();
 }
@@ -66,91 +72,117 @@ intptr_t grpc_vst_communicatorClient::dispatcher(AEffect *a, int b, int c, intpt
 void grpc_vst_communicatorClient::setParameter(AEffect *a, int b, float c)
 {
 	grpc_setParameter_Request request;
+	request.set_generation(m_generation);
 	request.set_param1(b);
 	request.set_param2(c);
 
 	grpc_setParameter_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_setParameter(&context, request, &reply);
 
 	if (!status.ok())
 		m_connected = false;
 
-	a->magic = reply.magic();
-	a->numPrograms = reply.numprograms();
-	a->numParams = reply.numparams();
-	a->numInputs = reply.numinputs();
-	a->numOutputs = reply.numoutputs();
-	a->flags = reply.flags();
-	a->initialDelay = reply.initialdelay();
-	a->uniqueID = reply.uniqueid();
-	a->version = reply.version();
+	applyAEffect(a, reply);
 }
 
 float grpc_vst_communicatorClient::getParameter(AEffect *a, int b)
 {
 	grpc_getParameter_Request request;
+	request.set_generation(m_generation);
 	request.set_param1(b);
 
 	grpc_getParameter_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_getParameter(&context, request, &reply);
 
 	if (!status.ok())
 		m_connected = false;
 
-	a->magic = reply.magic();
-	a->numPrograms = reply.numprograms();
-	a->numParams = reply.numparams();
-	a->numInputs = reply.numinputs();
-	a->numOutputs = reply.numoutputs();
-	a->flags = reply.flags();
-	a->initialDelay = reply.initialdelay();
-	a->uniqueID = reply.uniqueid();
-	a->version = reply.version();
+	applyAEffect(a, reply);
 	return reply.returnval();
 }
 
-void grpc_vst_communicatorClient::processReplacing(AEffect *a, float **adata, float **bdata, int frames, int arraySize)
+bool grpc_vst_communicatorClient::processReplacing(AEffect *a, float **adata, int numInputs, float **bdata, int numOutputs, int frames)
 {
-	std::string adataBuffer;
-	std::string bdataBuffer;
+	if (m_sharedAudio != nullptr)
+		return processReplacingShared(a, adata, numInputs, bdata, numOutputs, frames);
 
-	for (int c = 0; c < arraySize; c++) {
-		adataBuffer.append((char *)adata[c], frames * sizeof(float));
-		bdataBuffer.append((char *)bdata[c], frames * sizeof(float));
-	}
+	if (m_socketAudio != nullptr)
+		return processReplacingSocket(a, adata, numInputs, bdata, numOutputs, frames);
+
+	if (m_blockRequest == nullptr)
+		reserveAudioBuffers(uint32_t(frames), uint32_t(numInputs > numOutputs ? numInputs : numOutputs));
 
-	grpc_processReplacing_Request request;
-	request.set_arraysize(arraySize);
+	// Reused every block, resize stays within the capacity reserved up front
+	grpc_processReplacing_Request &request = *m_blockRequest;
+	request.set_generation(m_generation);
+	request.set_arraysize(numInputs);
+	request.set_outputsize(numOutputs);
 	request.set_frames(frames);
-	request.set_adata(adataBuffer);
-	request.set_bdata(bdataBuffer);
 
-	grpc_processReplacing_Reply reply;
-	ClientContext context;
-	Status status = stub_->com_grpc_processReplacing(&context, request, &reply);
+	std::string *adataBuffer = request.mutable_adata();
+	adataBuffer->resize(size_t(numInputs) * frames * sizeof(float));
 
-	if (!status.ok())
-		m_connected = false;
+	AudioKernels::packPlanes(reinterpret_cast<float *>(&(*adataBuffer)[0]), adata, numInputs, uint32_t(frames));
+
+	grpc_processReplacing_Reply &reply = *m_blockReply;
+
+	// Stream replies are read on m_streamThread, so a block waits no longer for one than for a unary reply
+	if (m_stream != nullptr) {
+		std::unique_lock<std::mutex> lock(m_streamMutex);
+
+		// The last block's reply is still on its way. Nothing more is written meanwhile, so a stalled proxy never blocks Write
+		if (m_streamReceived < m_streamSent)
+			return finishBlock(false);
+
+		m_streamAwaited = ++m_streamSent;
+		m_streamReady = false;
+		lock.unlock();
 
-	size_t read_idx_a = 0;
-	size_t read_idx_b = 0;
+		if (!m_stream->Write(request)) {
+			m_connected = false;
+			return false;
+		}
+
+		lock.lock();
+		const bool answered = m_streamCondition.wait_for(lock, std::chrono::milliseconds(m_blockDeadlineMs.load()),
+								 [this]() { return m_streamReady || m_streamBroken; });
+
+		if (m_streamBroken) {
+			m_connected = false;
+			return false;
+		}
+
+		// Dropped by the reader once it comes
+		if (!answered) {
+			m_streamAwaited = 0;
+			return finishBlock(false);
+		}
+	} else {
+		ClientContext context;
+		addInstance(context);
+		context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(m_blockDeadlineMs.load()));
+		Status status = m_audioStub->com_grpc_processReplacing(&context, request, &reply);
+
+		if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED)
+			return finishBlock(false);
 
-	for (int c = 0; c < arraySize; c++) {
-		StlBuffer::pop_buffer(reply.adata(), read_idx_a, (char *)adata[c], frames * sizeof(float));
-		StlBuffer::pop_buffer(reply.bdata(), read_idx_b, (char *)bdata[c], frames * sizeof(float));
+		if (!status.ok()) {
+			m_connected = false;
+			return false;
+		}
 	}
 
-	a->magic = reply.magic();
-	a->numPrograms = reply.numprograms();
-	a->numParams = reply.numparams();
-	a->numInputs = reply.numinputs();
-	a->numOutputs = reply.numoutputs();
-	a->flags = reply.flags();
-	a->initialDelay = reply.initialdelay();
-	a->uniqueID = reply.uniqueid();
-	a->version = reply.version();
+	// Only as many planes as the reply really holds
+	const size_t planeBytes = size_t(frames) * sizeof(float);
+	const int planes = planeBytes > 0 ? std::min({numOutputs, reply.arraysize(), int(reply.bdata().size() / planeBytes)}) : 0;
+	AudioKernels::unpackPlanes(bdata, reinterpret_cast<const float *>(reply.bdata().data()), planes, uint32_t(frames));
+
+	applyAEffect(a, reply);
+	return finishBlock(true);
 }
 
 void grpc_vst_communicatorClient::sendHwndMsg(AEffect * /*a*/, int msgType)
@@ -160,6 +192,7 @@ void grpc_vst_communicatorClient::sendHwndMsg(AEffect * /*a*/, int msgType)
 
 	grpc_sendHwndMsg_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_sendHwndMsg(&context, request, &reply);
 
 	if (!status.ok())
@@ -168,36 +201,567 @@ void grpc_vst_communicatorClient::sendHwndMsg(AEffect * /*a*/, int msgType)
 
 void grpc_vst_communicatorClient::updateAEffect(AEffect *a)
 {
+	// Always ask for the full snapshot
 	grpc_updateAEffect_Request request;
 	request.set_nullreply(1);
+	request.set_generation(0);
 
 	grpc_updateAEffect_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_updateAEffect(&context, request, &reply);
 
 	if (!status.ok())
 		m_connected = false;
 
-	a->magic = reply.magic();
-	a->numPrograms = reply.numprograms();
-	a->numParams = reply.numparams();
-	a->numInputs = reply.numinputs();
-	a->numOutputs = reply.numoutputs();
-	a->flags = reply.flags();
-	a->initialDelay = reply.initialdelay();
-	a->uniqueID = reply.uniqueid();
-	a->version = reply.version();
+	applyAEffect(a, reply);
+}
+
+void grpc_vst_communicatorClient::refreshAEffect(AEffect *a)
+{
+	if (m_effectStale.exchange(false))
+		updateAEffect(a);
+}
+
+void grpc_vst_communicatorClient::markEffectStale()
+{
+	if (!m_effectStale.exchange(true) && m_effectStaleFunction != nullptr)
+		m_effectStaleFunction();
 }
 
 void grpc_vst_communicatorClient::stopServer(AEffect * /*a*/)
 {
+	// The server waits for open streams on shutdown, end ours first
+	closeInstance();
+
 	grpc_stopServer_Request request;
 	request.set_nullreply(0);
 
 	grpc_stopServer_Reply reply;
 	ClientContext context;
+	addInstance(context);
 	Status status = stub_->com_grpc_stopServer(&context, request, &reply);
 
 	if (!status.ok())
 		m_connected = false;
 }
+
+bool grpc_vst_communicatorClient::createInstance(const std::string &modulePath)
+{
+	grpc_createInstance_Request request;
+	request.set_modulepath(modulePath);
+
+	grpc_createInstance_Reply reply;
+	ClientContext context;
+	Status status = stub_->com_grpc_createInstance(&context, request, &reply);
+
+	if (!status.ok()) {
+		m_connected = false;
+		return false;
+	}
+
+	if (!reply.created())
+		return false;
+
+	m_instance = reply.instance();
+	return true;
+}
+
+bool grpc_vst_communicatorClient::setChain(const uint32_t *stages, const uint32_t count)
+{
+	grpc_setChain_Request request;
+
+	for (uint32_t i = 0; i < count; i++)
+		request.add_stages(stages[i]);
+
+	grpc_setChain_Reply reply;
+	ClientContext context;
+	addInstance(context);
+	Status status = stub_->com_grpc_setChain(&context, request, &reply);
+
+	if (!status.ok()) {
+		m_connected = false;
+		return false;
+	}
+
+	return reply.chained();
+}
+
+void grpc_vst_communicatorClient::closeInstance()
+{
+	stopWatchingParameters();
+	closeAudioStream();
+	m_sharedAudio = nullptr;
+	m_socketAudio = nullptr;
+}
+
+void grpc_vst_communicatorClient::addInstance(ClientContext &context) const
+{
+	// Instance 0 is what a proxy started for a single plug-in loads, it needs no metadata
+	if (m_instance != 0)
+		context.AddMetadata(InstanceMetadataKey, std::to_string(m_instance));
+}
+
+void grpc_vst_communicatorClient::reserveAudioBuffers(const uint32_t maxFrames, const uint32_t maxChannels)
+{
+	if (m_arena == nullptr) {
+		google::protobuf::ArenaOptions options;
+		options.initial_block = m_arenaBlock;
+		options.initial_block_size = sizeof(m_arenaBlock);
+
+		m_arena = std::make_unique<google::protobuf::Arena>(options);
+		m_blockRequest = google::protobuf::Arena::CreateMessage<grpc_processReplacing_Request>(m_arena.get());
+		m_blockReply = google::protobuf::Arena::CreateMessage<grpc_processReplacing_Reply>(m_arena.get());
+	}
+
+	const size_t bytes = size_t(maxFrames) * maxChannels * sizeof(float);
+	m_blockRequest->mutable_adata()->reserve(bytes);
+	m_blockReply->mutable_bdata()->reserve(bytes);
+}
+
+grpc_vst_communicatorClient::BlockBuffers grpc_vst_communicatorClient::blockBuffers() const
+{
+	if (m_arena == nullptr)
+		return {0, nullptr, nullptr};
+
+	return {m_arena->SpaceAllocated(), m_blockRequest->adata().data(), m_blockReply->bdata().data()};
+}
+
+bool grpc_vst_communicatorClient::openAudioStream()
+{
+	closeAudioStream();
+
+	m_streamContext = std::make_unique<ClientContext>();
+	addInstance(*m_streamContext);
+	m_stream = m_audioStub->com_grpc_processStream(m_streamContext.get());
+
+	if (m_stream == nullptr) {
+		m_streamContext = nullptr;
+		return false;
+	}
+
+	// Replies are read into the block reply, which the caller doesn't touch until the one it waits for is there
+	if (m_blockReply == nullptr)
+		reserveAudioBuffers(0, 0);
+
+	m_streamSent = 0;
+	m_streamReceived = 0;
+	m_streamAwaited = 0;
+	m_streamReady = false;
+	m_streamBroken = false;
+
+	m_streamThread = std::thread([this]() {
+		for (;;) {
+			// One reply per block and in order, the next can't arrive before the next Write, which waits for this one to be unpacked
+			const bool read = m_stream->Read(m_blockReply);
+
+			std::lock_guard<std::mutex> grd(m_streamMutex);
+
+			if (!read) {
+				m_streamBroken = true;
+				m_streamCondition.notify_all();
+				return;
+			}
+
+			// Replies to blocks that stopped waiting are dropped
+			if (++m_streamReceived == m_streamAwaited) {
+				m_streamReady = true;
+				m_streamCondition.notify_all();
+			}
+		}
+	});
+
+	m_lastReply = std::chrono::steady_clock::now();
+	return true;
+}
+
+void grpc_vst_communicatorClient::closeAudioStream()
+{
+	if (m_stream == nullptr)
+		return;
+
+	// A proxy stalled in the plug-in may never answer, cancelling ends the reader's Read either way
+	m_stream->WritesDone();
+	m_streamContext->TryCancel();
+
+	if (m_streamThread.joinable())
+		m_streamThread.join();
+
+	m_stream->Finish();
+
+	m_stream = nullptr;
+	m_streamContext = nullptr;
+}
+
+bool grpc_vst_communicatorClient::watchParameters()
+{
+	stopWatchingParameters();
+
+	grpc_watchParameters_Request request;
+	request.set_nullreply(0);
+
+	m_watchContext = std::make_unique<ClientContext>();
+	addInstance(*m_watchContext);
+	m_watchReader = stub_->com_grpc_watchParameters(m_watchContext.get(), request);
+
+	if (m_watchReader == nullptr) {
+		m_watchContext = nullptr;
+		return false;
+	}
+
+	m_watchThread = std::thread([this]() {
+		grpc_parameterChanges changes;
+
+		while (m_watchReader->Read(&changes)) {
+			const int count = std::min(changes.indices_size(), changes.values_size());
+
+			if (m_parametersChangedFunction != nullptr)
+				m_parametersChangedFunction(changes.numparams(), changes.indices().data(), changes.values().data(), count);
+		}
+	});
+
+	return true;
+}
+
+void grpc_vst_communicatorClient::stopWatchingParameters()
+{
+	if (m_watchReader == nullptr)
+		return;
+
+	m_watchContext->TryCancel();
+
+	if (m_watchThread.joinable())
+		m_watchThread.join();
+
+	m_watchReader->Finish();
+	m_watchReader = nullptr;
+	m_watchContext = nullptr;
+}
+
+bool grpc_vst_communicatorClient::attachSharedAudio(AEffect * /*a*/, const std::string &name, const uint32_t maxFrames, const uint32_t maxChannels)
+{
+	auto ring = std::make_unique<SharedAudio::Ring>();
+
+	if (!ring->create(name, maxFrames, maxChannels))
+		return false;
+
+	grpc_attachSharedAudio_Request request;
+	request.set_name(name);
+
+	grpc_attachSharedAudio_Reply reply;
+	ClientContext context;
+	addInstance(context);
+	Status status = stub_->com_grpc_attachSharedAudio(&context, request, &reply);
+
+	if (!status.ok()) {
+		m_connected = false;
+		return false;
+	}
+
+	if (!reply.attached())
+		return false;
+
+	m_sharedAudio = std::move(ring);
+	m_sharedSequence = 0;
+	m_lastReply = std::chrono::steady_clock::now();
+	return true;
+}
+
+bool grpc_vst_communicatorClient::attachSocketAudio(AEffect * /*a*/, const std::string &path, const uint32_t maxFrames)
+{
+	grpc_attachSocketAudio_Request request;
+	request.set_path(path);
+
+	grpc_attachSocketAudio_Reply reply;
+	ClientContext context;
+	addInstance(context);
+	Status status = stub_->com_grpc_attachSocketAudio(&context, request, &reply);
+
+	if (!status.ok()) {
+		m_connected = false;
+		return false;
+	}
+
+	if (!reply.attached())
+		return false;
+
+	auto socket = std::make_unique<SocketAudio::Socket>();
+
+	if (!socket->connect(path))
+		return false;
+
+	socket->setReceiveTimeout(AudioTimeoutMs);
+
+	m_socketScratch.assign(maxFrames > 0 ? maxFrames : 1, 0.0f);
+	m_socketAudio = std::move(socket);
+	m_socketSequence = 0;
+	m_socketInFlight = 0;
+	m_lastReply = std::chrono::steady_clock::now();
+	return true;
+}
+
+bool grpc_vst_communicatorClient::processReplacingShared(AEffect * /*a*/, float **adata, int numInputs, float **bdata, int numOutputs, int frames)
+{
+	// Anything still queued is a late reply to a block we already gave up on
+	m_pendingCount = 0;
+
+	while (m_sharedAudio->beginRead(SharedAudio::ToHost) != nullptr)
+		m_sharedAudio->endRead(SharedAudio::ToHost);
+
+	// A full ring means the proxy is still behind on earlier blocks, which counts as a miss
+	const uint32_t sequence = writeSharedBlock(adata, numInputs, numOutputs, frames);
+	return finishBlock(sequence != 0 && readSharedBlock(sequence, bdata, numOutputs, frames));
+}
+
+uint32_t grpc_vst_communicatorClient::writeSharedBlock(float **adata, int numInputs, int numOutputs, int frames)
+{
+	if (uint32_t(frames) > m_sharedAudio->maxFrames() || uint32_t(numInputs) > m_sharedAudio->maxChannels() ||
+	    uint32_t(numOutputs) > m_sharedAudio->maxChannels())
+		return 0;
+
+	SharedAudio::BlockHeader *block = m_sharedAudio->beginWrite(SharedAudio::ToProxy);
+
+	if (block == nullptr)
+		return 0;
+
+	// Zero is never handed out, callers use it for failure
+	if (++m_sharedSequence == 0)
+		++m_sharedSequence;
+
+	block->sequence = m_sharedSequence;
+	block->frames = uint32_t(frames);
+	block->numInputs = uint32_t(numInputs);
+	block->numOutputs = uint32_t(numOutputs);
+	block->flags = 0;
+
+	for (int c = 0; c < numInputs; c++)
+		memcpy(m_sharedAudio->channel(block, c), adata[c], frames * sizeof(float));
+
+	m_sharedAudio->endWrite(SharedAudio::ToProxy);
+	return m_sharedSequence;
+}
+
+bool grpc_vst_communicatorClient::readSharedBlock(const uint32_t sequence, float **bdata, int numOutputs, int frames)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_blockDeadlineMs.load());
+
+	for (;;) {
+		// Replies come back in order, older sequences answer blocks we gave up on
+		while (SharedAudio::BlockHeader *result = m_sharedAudio->beginRead(SharedAudio::ToHost)) {
+			const bool match = result->sequence == sequence;
+			const bool stale = result->generation != m_generation;
+
+			if (match) {
+				const uint32_t channels = result->numOutputs < uint32_t(numOutputs) ? result->numOutputs : uint32_t(numOutputs);
+
+				for (uint32_t c = 0; c < channels; c++)
+					memcpy(bdata[c], m_sharedAudio->channel(result, c), frames * sizeof(float));
+			}
+
+			m_sharedAudio->endRead(SharedAudio::ToHost);
+
+			if (match) {
+				// Blocks only carry the generation, the fields are fetched off the audio thread when they changed
+				if (stale)
+					markEffectStale();
+
+				return true;
+			}
+		}
+
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+		if (remaining <= 0)
+			return false;
+
+		m_sharedAudio->wait(SharedAudio::ToHost, uint32_t(remaining));
+	}
+}
+
+bool grpc_vst_communicatorClient::processReplacingSocket(AEffect * /*a*/, float **adata, int numInputs, float **bdata, int numOutputs, int frames)
+{
+	m_pendingCount = 0;
+
+	const uint32_t sequence = sendSocketBlock(adata, numInputs, numOutputs, frames);
+	return finishBlock(sequence != 0 && receiveSocketBlock(sequence, bdata, numOutputs, frames));
+}
+
+uint32_t grpc_vst_communicatorClient::sendSocketBlock(float **adata, int numInputs, int numOutputs, int frames)
+{
+	if (uint32_t(frames) > SocketAudio::MaxFrames || uint32_t(numInputs) > SocketAudio::MaxChannels || uint32_t(numOutputs) > SocketAudio::MaxChannels)
+		return 0;
+
+	// Keeps a stalled proxy from filling the socket buffer and blocking the send
+	if (m_socketInFlight >= MaxSocketInFlight)
+		return 0;
+
+	if (++m_socketSequence == 0)
+		++m_socketSequence;
+
+	SocketAudio::FrameHeader header = {};
+	header.opcode = SocketAudio::Process;
+	header.version = SocketAudio::FrameVersion;
+	header.sequence = m_socketSequence;
+	header.frames = uint32_t(frames);
+	header.channelMask = SocketAudio::lowChannelMask(numInputs);
+	header.outputMask = SocketAudio::lowChannelMask(numOutputs);
+	header.generation = m_generation;
+
+	if (!m_socketAudio->sendFrame(header, adata)) {
+		m_connected = false;
+		return 0;
+	}
+
+	m_socketInFlight++;
+	return header.sequence;
+}
+
+bool grpc_vst_communicatorClient::receiveSocketBlock(const uint32_t sequence, float **bdata, int numOutputs, int frames)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_blockDeadlineMs.load());
+
+	// Replies arrive in order, anything before ours answers a block we already gave up on
+	for (;;) {
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+		// Only ever give up between frames, a started frame is read to the end
+		if (remaining <= 0 || !m_socketAudio->waitReadable(uint32_t(remaining)))
+			return false;
+
+		SocketAudio::FrameHeader result;
+
+		if (!m_socketAudio->receiveHeader(result) || result.opcode != SocketAudio::Processed) {
+			m_connected = false;
+			return false;
+		}
+
+		if (m_socketInFlight > 0)
+			m_socketInFlight--;
+
+		const bool match = result.sequence == sequence && result.frames == uint32_t(frames);
+		const size_t planeBytes = size_t(result.frames) * sizeof(float);
+
+		for (uint32_t c = 0; c < SocketAudio::MaxChannels; c++) {
+			if ((result.channelMask & (1u << c)) == 0)
+				continue;
+
+			bool received;
+
+			if (match && c < uint32_t(numOutputs))
+				received = m_socketAudio->receive(bdata[c], planeBytes);
+			else
+				received = m_socketAudio->discard(planeBytes, m_socketScratch.data(), m_socketScratch.size() * sizeof(float));
+
+			if (!received) {
+				m_connected = false;
+				return false;
+			}
+		}
+
+		if (match) {
+			// Frames only carry the generation, the fields are fetched off the audio thread when they changed
+			if (result.generation != m_generation)
+				markEffectStale();
+
+			return true;
+		}
+	}
+}
+
+bool grpc_vst_communicatorClient::submitBlock(AEffect * /*a*/, float **adata, int numInputs, int numOutputs, int frames)
+{
+	if (!canPipeline() || m_pendingCount == MaxPendingBlocks)
+		return false;
+
+	uint32_t sequence;
+
+	if (m_sharedAudio != nullptr)
+		sequence = writeSharedBlock(adata, numInputs, numOutputs, frames);
+	else
+		sequence = sendSocketBlock(adata, numInputs, numOutputs, frames);
+
+	if (sequence == 0) {
+		finishBlock(false);
+		return false;
+	}
+
+	PendingBlock &pending = m_pending[(m_pendingHead + m_pendingCount) % MaxPendingBlocks];
+	pending.sequence = sequence;
+	pending.numOutputs = numOutputs;
+	pending.frames = frames;
+	m_pendingCount++;
+	return true;
+}
+
+bool grpc_vst_communicatorClient::collectBlock(AEffect * /*a*/, float **bdata, int &numOutputs, int &frames)
+{
+	if (m_pendingCount == 0)
+		return false;
+
+	const PendingBlock pending = m_pending[m_pendingHead];
+	m_pendingHead = (m_pendingHead + 1) % MaxPendingBlocks;
+	m_pendingCount--;
+
+	numOutputs = pending.numOutputs;
+	frames = pending.frames;
+
+	bool received;
+
+	if (m_sharedAudio != nullptr)
+		received = readSharedBlock(pending.sequence, bdata, numOutputs, frames);
+	else
+		received = receiveSocketBlock(pending.sequence, bdata, numOutputs, frames);
+
+	// A late reply is skipped by sequence when the next block is collected
+	return finishBlock(received);
+}
+
+bool grpc_vst_communicatorClient::finishBlock(const bool received)
+{
+	const auto now = std::chrono::steady_clock::now();
+
+	if (received) {
+		m_lastReply = now;
+		return true;
+	}
+
+	// Missed blocks are the caller's to cover, only a proxy silent for AudioTimeoutMs counts as gone
+	if (now - m_lastReply > std::chrono::milliseconds(AudioTimeoutMs))
+		m_connected = false;
+
+	return false;
+}
+
+template<typename Reply> void grpc_vst_communicatorClient::applyAEffect(AEffect *a, const Reply &reply)
+{
+	// Replies only carry the fields when our generation was out of date
+	if (!reply.has_aeffect())
+		return;
+
+	std::lock_guard<std::mutex> grd(m_generationMutex);
+
+	if (m_generation != 0 && reply.generation() <= m_generation)
+		return;
+
+	const AEffect previous = *a;
+	const grpc_AEffect &fields = reply.aeffect();
+
+	a->magic = fields.magic();
+	a->numPrograms = fields.numprograms();
+	a->numParams = fields.numparams();
+	a->numInputs = fields.numinputs();
+	a->numOutputs = fields.numoutputs();
+	a->flags = fields.flags();
+	a->initialDelay = fields.initialdelay();
+	a->uniqueID = fields.uniqueid();
+	a->version = fields.version();
+
+	const bool initial = m_generation == 0;
+	m_generation = reply.generation();
+
+	if (initial || m_effectChangedFunction == nullptr)
+		return;
+
+	if (previous.numInputs != a->numInputs || previous.numOutputs != a->numOutputs || previous.initialDelay != a->initialDelay)
+		m_effectChangedFunction(previous, *a);
+}
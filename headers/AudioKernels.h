@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OBS_VST_SSE2 1
+#endif
+
+/*
+ * Per block sample loops of the filter, kept apart from VSTPlugin so they stay
+ * small enough for the compiler to vectorize and for us to check. The ones in
+ * AudioKernels.cpp pick SSE2, AVX2 or AVX-512 once from the CPU at load.
+ */
+namespace AudioKernels {
+
+// Largest magnitude in the buffer, NaN counts as loud so a broken plug-in is never mistaken for silence
+inline float peak(const float *data, const uint32_t frames)
+{
+	uint32_t i = 0;
+	float result = 0.0f;
+
+#ifdef OBS_VST_SSE2
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 peak4 = _mm_setzero_ps();
+	__m128 nan4 = _mm_setzero_ps();
+
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 v = _mm_loadu_ps(data + i);
+		peak4 = _mm_max_ps(peak4, _mm_and_ps(v, signMask));
+		nan4 = _mm_or_ps(nan4, _mm_cmpunord_ps(v, v));
+	}
+
+	if (_mm_movemask_ps(nan4) != 0)
+		return INFINITY;
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, peak4);
+	result = std::fmax(std::fmax(lanes[0], lanes[1]), std::fmax(lanes[2], lanes[3]));
+#endif
+
+	for (; i < frames; i++) {
+		const float magnitude = std::fabs(data[i]);
+
+		if (std::isnan(magnitude))
+			return INFINITY;
+
+		result = std::fmax(result, magnitude);
+	}
+
+	return result;
+}
+
+// True when every channel stays at or below threshold, stops at the first loud channel
+inline bool isSilent(float *const *channels, const int numChannels, const uint32_t frames, const float threshold)
+{
+	for (int c = 0; c < numChannels; c++) {
+		if (channels[c] != nullptr && peak(channels[c], frames) > threshold)
+			return false;
+	}
+
+	return true;
+}
+
+// Instruction set the dispatched kernels run on. OBS_VST_KERNELS=scalar|sse2|avx2|avx512 caps it
+const char *instructionSet();
+
+// dst = from * (1 - gain) + to * gain, with gain ramping from 0 towards 1 over the block. dst may be from or to
+void crossfade(float *dst, const float *from, const float *to, const uint32_t frames);
+
+// NaN and infinity become silence and denormals zero, returns how many samples weren't finite
+uint32_t sanitize(float *data, const uint32_t frames);
+
+// Whole planes at once, with their own loops for mono, stereo, 5.1 and 7.1
+void copyPlanes(float *const *dst, const float *const *src, const int channels, const uint32_t frames);
+void zeroPlanes(float *const *planes, const int channels, const uint32_t frames);
+uint32_t sanitizePlanes(float *const *planes, const int channels, const uint32_t frames);
+
+// Planes to and from one buffer holding them one after the other, the layout blocks travel in
+void packPlanes(float *dst, const float *const *src, const int channels, const uint32_t frames);
+void unpackPlanes(float *const *dst, const float *src, const int channels, const uint32_t frames);
+
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// The most planes OBS hands a filter, the layout of the output mix decides how many carry audio
+#define VST_MAX_CHANNELS 8
+
+// One routing setting as parsed, a negative count is automatic routing
+struct ChannelMap {
+	int count{-1};
+	int8_t entries[VST_MAX_CHANNELS]{};
+
+	bool automatic() const { return count < 0; }
+};
+
+/*
+ * Which source channels feed the plug-in's inputs and which plug-in outputs go
+ * back to which channels. The filter keeps a row for each channel it reads or
+ * writes and nothing more, so buffers and copies follow what is routed.
+ */
+struct ChannelRouting {
+	// What a row takes when it isn't a plug-in output
+	static const int8_t Dry = -1;
+	static const int8_t Silent = -2;
+
+	// Source channel of each row, in channel order
+	int rows{0};
+	int8_t rowChannel[VST_MAX_CHANNELS]{};
+
+	// Row feeding each plug-in input, -1 feeds silence
+	int inputs{0};
+	int8_t inputRow[VST_MAX_CHANNELS]{};
+
+	// Plug-in output each row takes, or Dry or Silent
+	int outputs{0};
+	int8_t rowOutput[VST_MAX_CHANNELS]{};
+
+	// Rows are channels 0.. and both sides line up with them, so the plug-in reads and writes rows in place
+	bool direct{false};
+
+	bool operator==(const ChannelRouting &other) const
+	{
+		return rows == other.rows && inputs == other.inputs && outputs == other.outputs && direct == other.direct &&
+		       memcmp(rowChannel, other.rowChannel, sizeof(rowChannel)) == 0 && memcmp(inputRow, other.inputRow, sizeof(inputRow)) == 0 &&
+		       memcmp(rowOutput, other.rowOutput, sizeof(rowOutput)) == 0;
+	}
+	bool operator!=(const ChannelRouting &other) const { return !(*this == other); }
+};
+
+namespace ChannelRoutings {
+
+// "0,1" or "0,-,1", '-' is no channel. Empty text is automatic routing, false on anything malformed
+inline bool parse(const std::string &text, ChannelMap &map)
+{
+	map = ChannelMap();
+
+	if (text.find_first_not_of(" \t") == std::string::npos)
+		return true;
+
+	map.count = 0;
+
+	for (size_t pos = 0; pos <= text.size();) {
+		size_t end = text.find(',', pos);
+
+		if (end == std::string::npos)
+			end = text.size();
+
+		const size_t first = text.find_first_not_of(" \t", pos);
+		const size_t last = text.find_last_not_of(" \t", end - 1);
+
+		if (first >= end || last == std::string::npos || last < first || map.count == VST_MAX_CHANNELS) {
+			map = ChannelMap();
+			return false;
+		}
+
+		const std::string item = text.substr(first, last - first + 1);
+		char *rest = nullptr;
+		const long value = item == "-" ? -1 : strtol(item.c_str(), &rest, 10);
+
+		if (item != "-" && (*rest != '\0' || value < 0 || value >= VST_MAX_CHANNELS)) {
+			map = ChannelMap();
+			return false;
+		}
+
+		map.entries[map.count++] = int8_t(value);
+		pos = end + 1;
+	}
+
+	return true;
+}
+
+/*
+ * inputs lists the source channel of each plug-in input, outputs the plug-in
+ * output of each source channel. Automatic inputs feed input n from channel n,
+ * automatic outputs write channel n from output n and silence the channels the
+ * plug-in has no output for, as the filter always did. With explicit outputs,
+ * channels left out or routed to '-' keep their dry signal.
+ */
+inline ChannelRouting resolve(const ChannelMap &inputs, const ChannelMap &outputs, const int channels, const int numInputs, const int numOutputs)
+{
+	ChannelRouting routing;
+	bool used[VST_MAX_CHANNELS] = {};
+	int8_t inputChannel[VST_MAX_CHANNELS];
+	int8_t channelOutput[VST_MAX_CHANNELS];
+
+	const int pluginInputs = std::min(std::max(numInputs, 0), VST_MAX_CHANNELS);
+	const int pluginOutputs = std::min(std::max(numOutputs, 0), VST_MAX_CHANNELS);
+
+	routing.inputs = inputs.automatic() ? std::min(channels, pluginInputs) : std::min(inputs.count, pluginInputs);
+
+	for (int i = 0; i < routing.inputs; i++) {
+		const int channel = inputs.automatic() ? i : inputs.entries[i];
+		inputChannel[i] = int8_t(channel < channels ? channel : -1);
+
+		if (inputChannel[i] >= 0)
+			used[channel] = true;
+	}
+
+	if (outputs.automatic())
+		routing.outputs = std::min(channels, pluginOutputs);
+
+	for (int c = 0; c < channels; c++) {
+		if (outputs.automatic()) {
+			channelOutput[c] = int8_t(c < routing.outputs ? c : ChannelRouting::Silent);
+		} else {
+			const int output = c < outputs.count ? outputs.entries[c] : -1;
+			channelOutput[c] = int8_t(output >= 0 && output < pluginOutputs ? output : ChannelRouting::Dry);
+
+			// Only the outputs something is routed to come back from the proxy
+			if (channelOutput[c] >= 0)
+				routing.outputs = std::max(routing.outputs, output + 1);
+		}
+
+		if (channelOutput[c] != ChannelRouting::Dry)
+			used[c] = true;
+	}
+
+	int8_t channelRow[VST_MAX_CHANNELS];
+
+	for (int c = 0; c < channels; c++) {
+		if (!used[c])
+			continue;
+
+		channelRow[c] = int8_t(routing.rows);
+		routing.rowChannel[routing.rows] = int8_t(c);
+		routing.rowOutput[routing.rows] = channelOutput[c];
+		routing.rows++;
+	}
+
+	for (int i = 0; i < routing.inputs; i++)
+		routing.inputRow[i] = inputChannel[i] >= 0 ? channelRow[inputChannel[i]] : -1;
+
+	routing.direct = routing.outputs <= routing.rows;
+
+	for (int r = 0; r < routing.rows; r++) {
+		if (routing.rowChannel[r] != r || (routing.rowOutput[r] != r && !(routing.rowOutput[r] == ChannelRouting::Silent && r >= routing.outputs)))
+			routing.direct = false;
+	}
+
+	for (int i = 0; i < routing.inputs; i++) {
+		if (routing.inputRow[i] != i)
+			routing.direct = false;
+	}
+
+	return routing;
+}
+
+}
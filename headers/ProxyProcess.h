@@ -0,0 +1,84 @@
+#pragma once
+
+#ifdef WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace grpc {
+class Channel;
+}
+
+// A running proxy process and the number of filters using it
+struct ProxyProcess {
+#ifdef WIN32
+	PROCESS_INFORMATION info = {};
+#else
+	// Set to -1 once reaped, filters sharing the proxy check on it from their own threads
+	std::atomic<pid_t> pid{-1};
+#endif
+	int32_t port{0};
+	std::shared_ptr<grpc::Channel> channel;
+
+	// Audio blocks have a port and connection of their own, so they never queue behind a chunk or an editor call
+	int32_t audioPort{0};
+	std::shared_ptr<grpc::Channel> audioChannel;
+	uint32_t users{0};
+};
+
+/*
+ * Proxy processes of this OBS instance. Filters of one group join the same
+ * proxy, the others take the warm spare or start a proxy of their own.
+ *
+ * Starting, watching and ending a process is per platform, in win/ and
+ * linux/, everything else is shared.
+ */
+namespace ProxyProcesses {
+
+// A live proxy of the group with one more user, or nullptr
+std::shared_ptr<ProxyProcess> join(const std::string &group);
+
+// Lets the rest of the group join this proxy
+void publish(const std::string &group, const std::shared_ptr<ProxyProcess> &proxy);
+
+// Returns true when this was the proxy's last user
+bool leave(const std::shared_ptr<ProxyProcess> &proxy);
+
+// An idle proxy with its server up and its channel connected, taken with one user
+std::shared_ptr<ProxyProcess> takeSpare();
+
+// Starts a new spare in the background unless one is ready or on its way
+void warmSpare();
+
+// On module unload, no threads of this module may outlive it
+void stopSpare();
+
+// A new proxy binds whatever ports are free and reports them as "<port> <audio port>", loading its plug-in counts towards this
+const int ReportTimeoutMs = 5000;
+
+// Takes the ports from a proxy's report, false unless it names a control port
+bool takePorts(const std::string &report, ProxyProcess &proxy);
+
+// Opens the control and audio channels once the proxy has reported its ports
+void openChannels(ProxyProcess &proxy);
+uint32_t currentProcessId();
+
+// An empty module path starts a proxy without instances, waiting for createInstance
+std::shared_ptr<ProxyProcess> start(const std::string &modulePath);
+// Cheap enough to ask once per audio block, a crashed proxy is noticed without waiting for an RPC to fail
+bool isRunning(ProxyProcess &proxy);
+
+// Waits up to waitMs for the process to exit on its own in a detached thread, then kills it
+void end(ProxyProcess &proxy, const int waitMs);
+
+// Kills the process and waits for it, for proxies with nothing loaded
+void kill(ProxyProcess &proxy);
+
+}
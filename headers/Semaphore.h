@@ -0,0 +1,68 @@
+#pragma once
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <climits>
+#else
+#include <errno.h>
+#include <semaphore.h>
+#endif
+
+/*
+ * Process-local counting semaphore. post() neither blocks nor takes a lock,
+ * so a real-time thread can wake a worker with it without risking priority
+ * inversion. Each post wakes one wait, posts made before the wait aren't lost.
+ */
+class Semaphore {
+public:
+	Semaphore()
+	{
+#ifdef WIN32
+		m_handle = CreateSemaphoreA(NULL, 0, LONG_MAX, NULL);
+#else
+		sem_init(&m_semaphore, 0, 0);
+#endif
+	}
+
+	~Semaphore()
+	{
+#ifdef WIN32
+		if (m_handle != NULL)
+			CloseHandle(m_handle);
+#else
+		sem_destroy(&m_semaphore);
+#endif
+	}
+
+	Semaphore(const Semaphore &) = delete;
+	Semaphore &operator=(const Semaphore &) = delete;
+
+	void post()
+	{
+#ifdef WIN32
+		ReleaseSemaphore(m_handle, 1, NULL);
+#else
+		sem_post(&m_semaphore);
+#endif
+	}
+
+	void wait()
+	{
+#ifdef WIN32
+		WaitForSingleObject(m_handle, INFINITE);
+#else
+		while (sem_wait(&m_semaphore) != 0 && errno == EINTR) {
+		}
+#endif
+	}
+
+private:
+#ifdef WIN32
+	HANDLE m_handle{NULL};
+#else
+	sem_t m_semaphore;
+#endif
+};
@@ -0,0 +1,390 @@
+#pragma once
+
+#ifdef WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+/*
+ * Shared memory audio transport between obs-vst and the proxy process.
+ *
+ * The section holds two single-producer/single-consumer rings of fixed-size
+ * block slots, one per direction. The host writes input blocks into the
+ * ToProxy ring and reads processed blocks from the ToHost ring, the proxy
+ * does the opposite. Only the ring indices are shared atomics, a slot is
+ * owned by exactly one side between begin and end calls.
+ */
+namespace SharedAudio {
+
+enum Direction { ToProxy = 0, ToHost = 1, DirectionCount = 2 };
+
+static const uint32_t SectionMagic = 0x56535452;
+static const uint32_t SectionVersion = 3;
+static const uint32_t SlotCount = 4;
+static const size_t CacheLine = 64;
+
+// Requests carry numInputs planes, replies numOutputs planes and the proxy's AEffect generation
+struct BlockHeader {
+	uint32_t sequence;
+	uint32_t frames;
+	uint32_t numInputs;
+	uint32_t numOutputs;
+	uint32_t flags;
+	uint32_t generation;
+};
+
+struct RingIndices {
+	alignas(CacheLine) std::atomic<uint32_t> write;
+	alignas(CacheLine) std::atomic<uint32_t> read;
+};
+
+struct SectionHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t maxFrames;
+	uint32_t maxChannels;
+	RingIndices rings[DirectionCount];
+};
+
+static inline size_t alignUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+class Ring {
+public:
+	Ring() = default;
+	~Ring() { close(); }
+
+	Ring(const Ring &) = delete;
+	Ring &operator=(const Ring &) = delete;
+
+	// Host side, creates and initializes the section
+	bool create(const std::string &name, const uint32_t maxFrames, const uint32_t maxChannels)
+	{
+		close();
+
+		m_planeStride = alignUp(maxFrames * sizeof(float), CacheLine);
+		m_slotStride = alignUp(CacheLine + maxChannels * m_planeStride, CacheLine);
+		m_size = alignUp(sizeof(SectionHeader), CacheLine) + m_slotStride * SlotCount * DirectionCount;
+
+		if (!mapSection(name, true))
+			return false;
+
+		SectionHeader *header = new (m_base) SectionHeader();
+		header->maxFrames = maxFrames;
+		header->maxChannels = maxChannels;
+
+		for (auto &ring : header->rings) {
+			ring.write.store(0, std::memory_order_relaxed);
+			ring.read.store(0, std::memory_order_relaxed);
+		}
+
+		header->version = SectionVersion;
+		std::atomic_thread_fence(std::memory_order_release);
+		header->magic = SectionMagic;
+
+		m_header = header;
+		return true;
+	}
+
+	// Proxy side, attaches to a section created by the host
+	bool open(const std::string &name)
+	{
+		close();
+
+		if (!mapSection(name, false))
+			return false;
+
+		SectionHeader *header = reinterpret_cast<SectionHeader *>(m_base);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (header->magic != SectionMagic || header->version != SectionVersion) {
+			close();
+			return false;
+		}
+
+		m_planeStride = alignUp(header->maxFrames * sizeof(float), CacheLine);
+		m_slotStride = alignUp(CacheLine + header->maxChannels * m_planeStride, CacheLine);
+
+		if (alignUp(sizeof(SectionHeader), CacheLine) + m_slotStride * SlotCount * DirectionCount > m_size) {
+			close();
+			return false;
+		}
+
+		m_header = header;
+		return true;
+	}
+
+	void close()
+	{
+		m_header = nullptr;
+
+#ifdef WIN32
+		for (auto &evt : m_events) {
+			if (evt != NULL)
+				CloseHandle(evt);
+
+			evt = NULL;
+		}
+
+		if (m_base != nullptr)
+			UnmapViewOfFile(m_base);
+
+		if (m_mapping != NULL)
+			CloseHandle(m_mapping);
+
+		m_mapping = NULL;
+#else
+		for (int dir = 0; dir < DirectionCount; dir++) {
+			if (m_events[dir] != SEM_FAILED)
+				sem_close(m_events[dir]);
+
+			m_events[dir] = SEM_FAILED;
+
+			if (m_owner)
+				sem_unlink(eventName(Direction(dir)).c_str());
+		}
+
+		if (m_base != nullptr)
+			munmap(m_base, m_size);
+
+		if (m_owner)
+			shm_unlink(("/" + m_name).c_str());
+#endif
+		m_base = nullptr;
+		m_owner = false;
+	}
+
+	bool isOpen() const { return m_header != nullptr; }
+	uint32_t maxFrames() const { return m_header->maxFrames; }
+	uint32_t maxChannels() const { return m_header->maxChannels; }
+
+	// Producer, returns nullptr when the ring is full
+	BlockHeader *beginWrite(const Direction dir)
+	{
+		RingIndices &ring = m_header->rings[dir];
+		const uint32_t write = ring.write.load(std::memory_order_relaxed);
+
+		if (write - ring.read.load(std::memory_order_acquire) >= SlotCount)
+			return nullptr;
+
+		return slot(dir, write);
+	}
+
+	void endWrite(const Direction dir)
+	{
+		RingIndices &ring = m_header->rings[dir];
+		ring.write.store(ring.write.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		signal(dir);
+	}
+
+	// Consumer, returns nullptr when the ring is empty
+	BlockHeader *beginRead(const Direction dir)
+	{
+		RingIndices &ring = m_header->rings[dir];
+		const uint32_t read = ring.read.load(std::memory_order_relaxed);
+
+		if (read == ring.write.load(std::memory_order_acquire))
+			return nullptr;
+
+		return slot(dir, read);
+	}
+
+	void endRead(const Direction dir)
+	{
+		RingIndices &ring = m_header->rings[dir];
+		ring.read.store(ring.read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	float *channel(BlockHeader *block, const uint32_t channel) const
+	{
+		return reinterpret_cast<float *>(reinterpret_cast<char *>(block) + CacheLine + channel * m_planeStride);
+	}
+
+	void signal(const Direction dir)
+	{
+#ifdef WIN32
+		SetEvent(m_events[dir]);
+#else
+		sem_post(m_events[dir]);
+#endif
+	}
+
+	// Without a timeout, for a side that only wakes for blocks or a signal to stop
+	void wait(const Direction dir)
+	{
+#ifdef WIN32
+		WaitForSingleObject(m_events[dir], INFINITE);
+#else
+		while (sem_wait(m_events[dir]) != 0 && errno == EINTR) {
+		}
+#endif
+	}
+
+	// Returns false on timeout, wakeups may be spurious so callers re-check the ring
+	bool wait(const Direction dir, const uint32_t timeoutMs)
+	{
+#ifdef WIN32
+		return WaitForSingleObject(m_events[dir], timeoutMs) == WAIT_OBJECT_0;
+#else
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeoutMs / 1000;
+		ts.tv_nsec += long(timeoutMs % 1000) * 1000000L;
+
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (sem_timedwait(m_events[dir], &ts) != 0) {
+			if (errno != EINTR)
+				return false;
+		}
+
+		return true;
+#endif
+	}
+
+private:
+	BlockHeader *slot(const Direction dir, const uint32_t index) const
+	{
+		size_t offset = alignUp(sizeof(SectionHeader), CacheLine);
+		offset += (size_t(dir) * SlotCount + (index % SlotCount)) * m_slotStride;
+		return reinterpret_cast<BlockHeader *>(m_base + offset);
+	}
+
+	std::string eventName(const Direction dir) const { return "/" + m_name + "-" + std::to_string(int(dir)); }
+
+	bool mapSection(const std::string &name, const bool create)
+	{
+		m_name = name;
+		m_owner = create;
+
+#ifdef WIN32
+		const std::string sectionName = "Local\\" + name;
+
+		if (create) {
+			m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(m_size) >> 32), DWORD(m_size & 0xFFFFFFFF),
+						       sectionName.c_str());
+		} else {
+			m_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, sectionName.c_str());
+		}
+
+		if (m_mapping == NULL)
+			return false;
+
+		m_base = static_cast<char *>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+
+		if (m_base == nullptr) {
+			close();
+			return false;
+		}
+
+		if (!create) {
+			MEMORY_BASIC_INFORMATION info;
+			VirtualQuery(m_base, &info, sizeof(info));
+			m_size = info.RegionSize;
+		}
+
+		for (int dir = 0; dir < DirectionCount; dir++) {
+			const std::string evtName = "Local\\" + name + "-" + std::to_string(dir);
+
+			if (create)
+				m_events[dir] = CreateEventA(NULL, FALSE, FALSE, evtName.c_str());
+			else
+				m_events[dir] = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, evtName.c_str());
+
+			if (m_events[dir] == NULL) {
+				close();
+				return false;
+			}
+		}
+#else
+		const std::string sectionName = "/" + name;
+		int fd = create ? shm_open(sectionName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600) : shm_open(sectionName.c_str(), O_RDWR, 0);
+
+		if (fd < 0)
+			return false;
+
+		if (create) {
+			if (ftruncate(fd, off_t(m_size)) != 0) {
+				::close(fd);
+				close();
+				return false;
+			}
+		} else {
+			struct stat st;
+
+			if (fstat(fd, &st) != 0) {
+				::close(fd);
+				return false;
+			}
+
+			m_size = size_t(st.st_size);
+		}
+
+		void *base = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (base == MAP_FAILED) {
+			close();
+			return false;
+		}
+
+		m_base = static_cast<char *>(base);
+
+		for (int dir = 0; dir < DirectionCount; dir++) {
+			const std::string evtName = eventName(Direction(dir));
+
+			if (create) {
+				sem_unlink(evtName.c_str());
+				m_events[dir] = sem_open(evtName.c_str(), O_CREAT | O_EXCL, 0600, 0);
+			} else {
+				m_events[dir] = sem_open(evtName.c_str(), 0);
+			}
+
+			if (m_events[dir] == SEM_FAILED) {
+				close();
+				return false;
+			}
+		}
+#endif
+		return true;
+	}
+
+private:
+	std::string m_name;
+	bool m_owner{false};
+
+	char *m_base{nullptr};
+	size_t m_size{0};
+	size_t m_planeStride{0};
+	size_t m_slotStride{0};
+
+	SectionHeader *m_header{nullptr};
+
+#ifdef WIN32
+	HANDLE m_mapping{NULL};
+	HANDLE m_events[DirectionCount]{NULL, NULL};
+#else
+	sem_t *m_events[DirectionCount]{SEM_FAILED, SEM_FAILED};
+#endif
+};
+
+}
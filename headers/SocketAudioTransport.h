@@ -0,0 +1,352 @@
+#pragma once
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * Unix domain socket audio transport between obs-vst and the proxy process.
+ *
+ * Every frame is a fixed FrameHeader followed by one plane of header.frames
+ * floats for each bit set in channelMask, lowest channel first. There is no
+ * encoding step, planes go out with a single gathered write and are read
+ * straight into their destination buffers.
+ *
+ * Winsock is expected to be initialized already, both processes start gRPC
+ * before any audio socket is opened.
+ */
+namespace SocketAudio {
+
+#ifdef WIN32
+typedef SOCKET Handle;
+static const Handle InvalidHandle = INVALID_SOCKET;
+#else
+typedef int Handle;
+static const Handle InvalidHandle = -1;
+#endif
+
+enum Opcode : uint16_t { Process = 1, Processed = 2 };
+
+static const uint16_t FrameVersion = 1;
+static const uint32_t MaxChannels = 32;
+static const uint32_t MaxFrames = 16384;
+
+struct FrameHeader {
+	uint16_t opcode;
+	uint16_t version;
+	uint32_t sequence;
+	uint32_t frames;
+	uint32_t channelMask; // planes following this header
+	uint32_t outputMask;  // Process: outputs wanted back
+	uint32_t generation;  // Processed: proxy's AEffect generation
+};
+
+static_assert(sizeof(FrameHeader) == 24, "FrameHeader layout is part of the protocol");
+
+static inline uint32_t lowChannelMask(const int count)
+{
+	if (count <= 0)
+		return 0;
+
+	return count >= int(MaxChannels) ? 0xFFFFFFFFu : (1u << count) - 1;
+}
+
+// Number of channels up to and including the highest set bit
+static inline uint32_t channelSpan(uint32_t mask)
+{
+	uint32_t span = 0;
+
+	while (mask != 0) {
+		mask >>= 1;
+		span++;
+	}
+
+	return span;
+}
+
+class Socket {
+public:
+	Socket() = default;
+	~Socket() { close(); }
+
+	Socket(const Socket &) = delete;
+	Socket &operator=(const Socket &) = delete;
+
+	bool listen(const std::string &path)
+	{
+		close();
+
+		sockaddr_un addr;
+
+		if (!makeAddress(path, addr))
+			return false;
+
+		m_handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (m_handle == InvalidHandle)
+			return false;
+
+		removePath(path);
+
+		if (::bind(m_handle, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(m_handle, 1) != 0) {
+			close();
+			return false;
+		}
+
+		m_path = path;
+		return true;
+	}
+
+	// Blocks until a peer connects, there is no timeout
+	bool accept(Socket &listener)
+	{
+		close();
+
+		m_handle = ::accept(listener.m_handle, nullptr, nullptr);
+		return m_handle != InvalidHandle;
+	}
+
+	bool connect(const std::string &path)
+	{
+		close();
+
+		sockaddr_un addr;
+
+		if (!makeAddress(path, addr))
+			return false;
+
+		m_handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (m_handle == InvalidHandle)
+			return false;
+
+		if (::connect(m_handle, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void setReceiveTimeout(const uint32_t timeoutMs)
+	{
+#ifdef WIN32
+		DWORD timeout = timeoutMs;
+		setsockopt(m_handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+#else
+		timeval timeout;
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_usec = (timeoutMs % 1000) * 1000;
+		setsockopt(m_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+	}
+
+	bool waitReadable(const uint32_t timeoutMs)
+	{
+#ifdef WIN32
+		WSAPOLLFD pfd = {m_handle, POLLRDNORM, 0};
+		return WSAPoll(&pfd, 1, int(timeoutMs)) > 0;
+#else
+		pollfd pfd = {m_handle, POLLIN, 0};
+		return ::poll(&pfd, 1, int(timeoutMs)) > 0;
+#endif
+	}
+
+	void close()
+	{
+		if (m_handle != InvalidHandle) {
+#ifdef WIN32
+			closesocket(m_handle);
+#else
+			::close(m_handle);
+#endif
+		}
+
+		m_handle = InvalidHandle;
+
+		// Listener owns the path
+		if (!m_path.empty())
+			removePath(m_path);
+
+		m_path.clear();
+	}
+
+	// Ends a receive blocked on this socket from another thread, the handle stays valid until close()
+	void shutdown()
+	{
+		if (m_handle == InvalidHandle)
+			return;
+
+#ifdef WIN32
+		::shutdown(m_handle, SD_BOTH);
+#else
+		::shutdown(m_handle, SHUT_RDWR);
+#endif
+	}
+
+	bool isOpen() const { return m_handle != InvalidHandle; }
+	const std::string &path() const { return m_path; }
+
+	// planes holds one pointer per set bit of header.channelMask, in channel order
+	bool sendFrame(const FrameHeader &header, float *const *planes)
+	{
+		const size_t planeBytes = size_t(header.frames) * sizeof(float);
+		const uint32_t count = channelCount(header.channelMask);
+
+#ifdef WIN32
+		WSABUF buffers[MaxChannels + 1];
+		buffers[0].buf = (char *)&header;
+		buffers[0].len = sizeof(header);
+
+		for (uint32_t i = 0; i < count; i++) {
+			buffers[i + 1].buf = (char *)planes[i];
+			buffers[i + 1].len = ULONG(planeBytes);
+		}
+
+		DWORD sent = 0;
+
+		if (WSASend(m_handle, buffers, count + 1, &sent, 0, nullptr, nullptr) != 0)
+			return false;
+
+		return sent == sizeof(header) + count * planeBytes;
+#else
+		iovec buffers[MaxChannels + 1];
+		buffers[0].iov_base = const_cast<FrameHeader *>(&header);
+		buffers[0].iov_len = sizeof(header);
+
+		for (uint32_t i = 0; i < count; i++) {
+			buffers[i + 1].iov_base = planes[i];
+			buffers[i + 1].iov_len = planeBytes;
+		}
+
+		iovec *pending = buffers;
+		int pendingCount = int(count + 1);
+
+		while (pendingCount > 0) {
+			msghdr msg = {};
+			msg.msg_iov = pending;
+			msg.msg_iovlen = pendingCount;
+
+			ssize_t sent = ::sendmsg(m_handle, &msg, MSG_NOSIGNAL);
+
+			if (sent < 0) {
+				if (errno == EINTR)
+					continue;
+
+				return false;
+			}
+
+			// Partial write, skip what went out and resend the rest
+			while (pendingCount > 0 && size_t(sent) >= pending->iov_len) {
+				sent -= pending->iov_len;
+				pending++;
+				pendingCount--;
+			}
+
+			if (pendingCount > 0) {
+				pending->iov_base = static_cast<char *>(pending->iov_base) + sent;
+				pending->iov_len -= sent;
+			}
+		}
+
+		return true;
+#endif
+	}
+
+	bool receiveHeader(FrameHeader &header)
+	{
+		if (!receive(&header, sizeof(header)))
+			return false;
+
+		return header.version == FrameVersion;
+	}
+
+	bool receive(void *data, size_t size)
+	{
+		char *dst = static_cast<char *>(data);
+
+		while (size > 0) {
+#ifdef WIN32
+			int received = ::recv(m_handle, dst, int(size), MSG_WAITALL);
+#else
+			ssize_t received = ::recv(m_handle, dst, size, MSG_WAITALL);
+
+			if (received < 0 && errno == EINTR)
+				continue;
+#endif
+			if (received <= 0)
+				return false;
+
+			dst += received;
+			size -= size_t(received);
+		}
+
+		return true;
+	}
+
+	// Reads and drops size bytes through scratch
+	bool discard(size_t size, void *scratch, const size_t scratchSize)
+	{
+		while (size > 0) {
+			const size_t chunk = size < scratchSize ? size : scratchSize;
+
+			if (!receive(scratch, chunk))
+				return false;
+
+			size -= chunk;
+		}
+
+		return true;
+	}
+
+	static uint32_t channelCount(uint32_t mask)
+	{
+		uint32_t count = 0;
+
+		for (; mask != 0; mask &= mask - 1)
+			count++;
+
+		return count;
+	}
+
+private:
+	static bool makeAddress(const std::string &path, sockaddr_un &addr)
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+
+		if (path.size() >= sizeof(addr.sun_path))
+			return false;
+
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		return true;
+	}
+
+	static void removePath(const std::string &path)
+	{
+#ifdef WIN32
+		DeleteFileA(path.c_str());
+#else
+		::unlink(path.c_str());
+#endif
+	}
+
+private:
+	Handle m_handle{InvalidHandle};
+	std::string m_path;
+};
+
+}
@@ -19,8 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef OBS_STUDIO_VSTPLUGIN_H
 #define OBS_STUDIO_VSTPLUGIN_H
 
-#define VST_MAX_CHANNELS 8
-#define BLOCK_SIZE 512
+// One OBS audio tick, the block size negotiated with the plug-in and the most a transport carries per block
+#define MAX_BLOCK_SIZE AUDIO_OUTPUT_FRAMES
+#define MIN_BLOCK_SIZE 128
 
 #ifdef WIN32
 #define NOMINMAX
@@ -28,13 +29,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 #include <string>
+#include <vector>
 #include <obs-module.h>
 #include "aeffectx.h"
+#include "ChannelRouting.h"
+#include "Semaphore.h"
 #include <thread>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 
 class grpc_vst_communicatorClient;
+struct ProxyProcess;
 
 enum VstChunkType { Bank, Program, Parameter };
 
@@ -53,7 +61,57 @@ public:
 	void getSourceNames();
 	void setOpenInterfaceWhenActive(const bool val) { m_openInterfaceWhenActive = val; }
 
+	// Pipelined processing returns the previous block's result, trading one block of latency for concurrency
+	void setPipelined(const bool val) { m_pipelined = val; }
+	uint32_t getLatencyFrames() const { return m_latencyFrames; }
+
+	// Plug-in delay plus our own, published on the filter as the latency_changed signal and the get_latency proc
+	uint32_t getTotalLatencyFrames() const { return m_totalLatencyFrames; }
+
+	// Collects input into whole blocks so the plug-in never sees a short one, adding one block of latency. Pipelined processing takes precedence
+	void setReblocking(const bool val) { m_reblocking = val; }
+
+	// Comma separated channel lists, see ChannelRoutings::resolve. Malformed lists fall back to automatic routing
+	void setChannelRouting(const std::string &inputs, const std::string &outputs);
+
+	// Filters with the same non-empty group share one proxy process, used on the next load
+	void setProxyGroup(const std::string &group) { m_proxyGroup = group; }
+	const std::string &getProxyGroup() const { return m_proxyGroup; }
+
+	// Deadline for each block's reply as a multiple of the block's duration, misses play the dry input
+	void setDeadlineBlocks(const double val) { m_deadlineBlocks = val; }
+	uint64_t getXrunCount() const { return m_xruns; }
+	uint64_t getSanitizedBlockCount() const { return m_sanitizedBlocks; }
+
+	// Adaptive blocks start at a whole tick and halve while a block's round trip exceeds the target, they grow back when there's room
+	void setAdaptiveBlocks(const bool enabled, const double targetMs)
+	{
+		m_adaptiveBlocks = enabled;
+		m_blockTargetMs = targetMs;
+	}
+	uint32_t getBlockSize() const { return m_blockSize; }
+
+	// No blocks go to the proxy while the input is silent or the source muted and the plug-in's output has stayed silent for the tail
+	void setSilenceGate(const bool enabled, const uint32_t tailMs)
+	{
+		m_silenceGate = enabled;
+		m_silenceTailMs = tailMs;
+	}
+	bool isGated() const { return m_gated; }
+
+	// A crashed proxy is restarted in the background with the last known state, audio passes through meanwhile
+	void cancelRestart();
+
+	// No restart is scheduled once this is called, the filter is about to be unloaded and destroyed
+	void beginDestroy();
+
+	// Called by OBS once the filter is taken off its source, which is then no longer watched for filter changes
+	void unwatchParent();
+	uint64_t getRestartCount() const { return m_restarts; }
+	uint32_t getLastRecoveryMs() const { return m_lastRecoveryMs; }
+
 	int getProgram();
+	float getParameter(const int index);
 
 	bool isEditorOpen();
 	bool hasWindowOpen();
@@ -71,16 +129,107 @@ public:
 	std::atomic<bool> m_proxyDisconnected{false};
 
 private:
+	// Starts a proxy process of our own, registered under m_proxyGroup when it's set
+	bool launchProxy();
 	void stopProxy();
+	void onEffectChanged(const AEffect &previous, const AEffect &current);
+	void onParametersChanged(const int numParams, const int *indices, const float *values, const int count);
+
+	void updateRouting(const int channels);
+	void gatherInputs(float **dry, float **inputs);
+	float **blockOutputs(const uint32_t frames);
+	void routeOutputs(float **dry, const uint32_t frames);
+
+	void processPipelined(float **rows, const uint32_t frames);
+	void coverBlock(float **dry, const int numChannels, const uint32_t frames, const bool received);
+	void pushDelayed(float **outputs, const int numOutputs, const uint32_t frames);
+	float *inFlightInput(const uint32_t slot, const int row) { return &m_inFlightInputs[(size_t(slot) * VST_MAX_CHANNELS + row) * MAX_BLOCK_SIZE]; }
+	void resetPipeline(const bool active, const uint32_t frames);
+	void processReblocked(float **rows, const uint32_t frames);
+	void resetReblock(const bool active);
+	float *reblockInput(const int channel) { return &m_reblockInput[size_t(channel) * ReblockCapacity]; }
+	float *reblockOutput(const int channel) { return &m_reblockOutput[size_t(channel) * ReblockCapacity]; }
+	void setLatency(const uint32_t frames);
+	void updateLatency();
+	void publishLatency();
+	static void getLatencyProc(void *data, calldata_t *cd);
+	void adaptBlockSize(const double callMs);
+	void requestBlockSize(const uint32_t blockSize);
+	void setBlockSize(const uint32_t blockSize);
+	void refreshEffect();
+
+	// Full blocks timed before the adaptive block size is reconsidered
+	static const uint32_t BlockSizeWindow = 64;
+	void trackSilence(float **rows, const uint32_t frames, const bool inputSilent, const bool muted);
+	bool sourceMuted() const;
+
+	// About -100 dBFS, below the dither of 16 bit sources
+	static constexpr float SilenceThreshold = 1e-5f;
+
+	void scheduleRestart();
+	void runControl();
+	void restartProxy();
+	void rememberChunk(const VstChunkType type, const std::string &data);
+	void restoreState();
+
+	// Attempts per crash, later ones back off so a plug-in that crashes while loading doesn't spin
+	static const int MaxRestartAttempts = 3;
+	static const uint32_t RestartBackoffMs = 250;
+
+	// Recoveries slower than this are logged as warnings
+	static const uint32_t RecoveryBudgetMs = 2000;
+
+	// Stops at the first filter after us that isn't a loaded VST filter in our proxy
+	static const uint32_t MaxChainStages = 16;
+
+	// Audio ticks between offers of a chain the proxy turned down, about a second
+	static const uint32_t ChainRetryTicks = 50;
 
-	int32_t chooseProxyPort();
+	// A filter's claim holds the audio tick in which the head of its chain ran it, shared so a head never writes to a destroyed filter
+	typedef std::shared_ptr<std::atomic<uint64_t>> ChainClaim;
+
+	struct ChainScan {
+		VSTPlugin *head;
+		bool started;
+		bool open;
+		uint32_t count;
+		uint32_t stages[MaxChainStages];
+		ChainClaim claims[MaxChainStages];
+		int outputs;
+	};
+
+	// Fuses the VST filters right after this one into our blocks, they then pass the audio through. Scanned on the control thread
+	// whenever filters of our source are added, removed, reordered, toggled or reloaded, never per audio tick
+	void updateChain();
+	bool addChainStage(VSTPlugin &next, ChainScan &scan);
+	bool sharesProxyWith(const VSTPlugin &other) const;
+	static void enumChainStage(obs_source_t *parent, obs_source_t *filter, void *param);
+	void requestChainUpdate();
+	void requestChainUpdates();
+	void watchParent();
+	static void onFiltersChanged(void *data, calldata_t *cd);
+	static void onEnabledChanged(void *data, calldata_t *cd);
 
 	bool m_is_open{false};
 	bool m_windowCreated{false};
 	bool m_openInterfaceWhenActive{false};
 
-	float **m_inputs{nullptr};
-	float **m_outputs{nullptr};
+	// Requested routing, handed to the audio thread when it changes
+	std::mutex m_routingMutex;
+	ChannelMap m_inputMap;
+	ChannelMap m_outputMap;
+	std::atomic<bool> m_routingChanged{true};
+	std::atomic<bool> m_routingAutomatic{true};
+
+	// Routing in use and its buffers, a row per channel there can be and the plug-in's outputs when they need routing
+	ChannelMap m_activeInputMap;
+	ChannelMap m_activeOutputMap;
+	ChannelRouting m_routing;
+	std::vector<float> m_outputData;
+	std::vector<float> m_pluginOutputData;
+	std::vector<float> m_silence;
+	float *m_outputs[VST_MAX_CHANNELS]{};
+	float *m_pluginOutputs[VST_MAX_CHANNELS]{};
 
 	char m_effectName[64];
 	char m_vendorString[64];
@@ -88,18 +237,122 @@ private:
 	std::string m_pluginPath;
 	std::string m_sourceName;
 	std::string m_filterName;
+	std::string m_proxyGroup;
 
 	std::recursive_mutex m_effectStatusMutex;
 
+	// Processed blocks waiting to be handed back one call late, per channel lines of m_delayCapacity frames
+	std::atomic<bool> m_pipelined{false};
+	bool m_pipelineActive{false};
+	std::vector<float> m_delayLine;
+	uint32_t m_delayCapacity{0};
+	uint32_t m_delayRead{0};
+	uint32_t m_delayFill{0};
+	std::atomic<uint32_t> m_latencyFrames{0};
+	std::atomic<uint32_t> m_totalLatencyFrames{0};
+	std::atomic<uint32_t> m_pluginLatencyFrames{0};
+	std::atomic<bool> m_latencyChanged{false};
+
+	// Per channel rows of ReblockCapacity frames, input waiting for a whole block and output waiting to be handed back. Sized for every channel up front
+	static const uint32_t ReblockCapacity = 2 * MAX_BLOCK_SIZE;
+	std::atomic<bool> m_reblocking{false};
+	bool m_reblockActive{false};
+	uint32_t m_reblockSize{0};
+	std::vector<float> m_reblockInput;
+	std::vector<float> m_reblockOutput;
+	uint32_t m_reblockInputFill{0};
+	uint32_t m_reblockOutputFill{0};
+
+	// Blocks submitted in pipelined mode, with their input kept in case the reply misses its deadline
+	struct PipelinedBlock {
+		uint32_t frames;
+		int numChannels;
+		bool submitted;
+	};
+
+	std::vector<PipelinedBlock> m_inFlight;
+	std::vector<float> m_inFlightInputs;
+	uint32_t m_inFlightHead{0};
+	uint32_t m_inFlightCount{0};
+
+	// Last processed block, faded out when the next one misses its deadline
+	std::atomic<double> m_deadlineBlocks{2.0};
+	std::vector<float> m_lastBlock;
+	uint32_t m_lastBlockFrames{0};
+	bool m_lastBlockMissed{false};
+	std::atomic<uint64_t> m_xruns{0};
+	std::atomic<uint64_t> m_sanitizedBlocks{0};
+
+	// Frames per block sent to the plug-in, effSetBlockSize is kept in step
+	std::atomic<uint32_t> m_blockSize{MAX_BLOCK_SIZE};
+	// Chosen on the audio thread, the control thread sends the dispatcher calls and then publishes m_blockSize. Zero when none is pending
+	std::atomic<uint32_t> m_requestedBlockSize{0};
+	std::atomic<bool> m_adaptiveBlocks{false};
+	std::atomic<double> m_blockTargetMs{5.0};
+	double m_blockCallMs{0.0};
+	uint32_t m_blockCalls{0};
+
+	// Frames in a row with silent input and silent output, the gate closes once they cover the tail
+	std::atomic<bool> m_silenceGate{false};
+	std::atomic<uint32_t> m_silenceTailMs{1000};
+	uint64_t m_quietFrames{0};
+	std::atomic<bool> m_gated{false};
+
+	// Stages last sent to the proxy, and the audio tick in which a filter before us claimed this one as a stage
+	uint32_t m_chainStages[MaxChainStages];
+	uint32_t m_chainCount{0};
+	bool m_chained{false};
+	const ChainClaim m_chainedAt{std::make_shared<std::atomic<uint64_t>>(UINT64_MAX)};
+
+	// Published by the control thread, the audio thread claims these stages each tick it runs them
+	ChainClaim m_chainClaims[MaxChainStages];
+	std::atomic<uint32_t> m_chainClaimCount{0};
+	std::atomic<int> m_chainOutputs{0};
+	std::atomic<bool> m_chainRequested{false};
+
+	// The proxy refuses a chain that would cross another head's, which can be one not yet cleared while filters are reordered
+	std::atomic<bool> m_chainRefused{false};
+	uint32_t m_chainRetryTicks{0};
+
+	// The source whose filter signals request our scans, and the parent the audio thread last saw to notice being added to another
+	std::mutex m_watchMutex;
+	obs_weak_source_t *m_watchedParent{nullptr};
+	std::atomic<obs_source_t *> m_seenParent{nullptr};
+
+	// Last chunks and program that went through this filter, replayed into a restarted proxy
+	std::mutex m_restoreMutex;
+	std::string m_restoreChunks[3];
+	int m_restoreProgram{-1};
+	std::vector<float> m_restoreParameters;
+
+	// Crashes are only flagged where they're noticed. The control thread tears down and restarts the proxy, and sends whatever else the
+	// audio thread can't wait for
+	std::thread m_controlThread;
+	Semaphore m_controlWakeup;
+	std::atomic<bool> m_controlStop{false};
+	std::atomic<bool> m_restartRequested{false};
+	std::atomic<bool> m_effectRefreshRequested{false};
+	std::atomic<bool> m_destroying{false};
+	std::mutex m_restartMutex;
+	std::condition_variable m_restartCondition;
+	bool m_restartStop{false};
+	std::atomic<bool> m_restarting{false};
+	std::chrono::steady_clock::time_point m_crashedAt;
+	std::atomic<uint64_t> m_restarts{0};
+	std::atomic<uint32_t> m_lastRecoveryMs{0};
+
+	// Mirror of the plug-in's parameters, kept current by changes the proxy pushes
+	std::mutex m_parameterMutex;
+	std::vector<float> m_parameters;
+	bool m_parametersMirrored{false};
+
 	std::unique_ptr<AEffect> m_effect;
 
 	obs_source_t *m_sourceContext;
 
 	std::unique_ptr<grpc_vst_communicatorClient> m_remote;
 
-#ifdef WIN32
-	PROCESS_INFORMATION m_winServer;
-#endif
+	std::shared_ptr<ProxyProcess> m_proxy;
 };
 
 #endif // OBS_STUDIO_VSTPLUGIN_H
@@ -3,28 +3,173 @@
 #include <obs_vst_api.grpc.pb.h>
 #include <grpcpp/grpcpp.h>
 
+#include "SharedAudioRing.h"
+#include "SocketAudioTransport.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReader;
+using grpc::ClientReaderWriter;
 using grpc::Status;
 
 class AEffect;
 
 class grpc_vst_communicatorClient {
 public:
-	grpc_vst_communicatorClient(std::shared_ptr<Channel> channel);
+	// Blocks go over audioChannel and everything else over channel, so control calls never hold up a block
+	grpc_vst_communicatorClient(std::shared_ptr<Channel> channel, std::shared_ptr<Channel> audioChannel, const uint32_t instance = 0);
+	~grpc_vst_communicatorClient();
 
 	intptr_t dispatcher(AEffect *a, int b, int c, intptr_t d, void *ptr, float f, size_t ptr_size);
 
 	float getParameter(AEffect *a, int b);
 
 	void setParameter(AEffect *a, int b, float c);
-	void processReplacing(AEffect *a, float **adata, float **bdata, int frames, int arraySize);
+	// Returns false when no output was written, either the block missed its deadline or the proxy is gone (m_connected)
+	bool processReplacing(AEffect *a, float **adata, int numInputs, float **bdata, int numOutputs, int frames);
 	void sendHwndMsg(AEffect *a, int msgType);
 	void updateAEffect(AEffect *a);
+
+	// Fetches the fields a block reported out of date, if one did. Blocks keep the previous fields until then
+	void refreshAEffect(AEffect *a);
 	void stopServer(AEffect *a);
 
+	// Loads another plug-in into an already running proxy, this client then talks to it instead
+	bool createInstance(const std::string &modulePath);
+	uint32_t instance() const { return m_instance; }
+
+	// Instances of the same proxy run after this one within each of its blocks, count 0 clears the chain
+	bool setChain(const uint32_t *stages, const uint32_t count);
+
+	// Ends this client's streams and audio transports, leaving the proxy and its other instances running
+	void closeInstance();
+
+	// Metadata entry naming the proxy instance a call is for
+	static constexpr const char *InstanceMetadataKey = "vst-instance";
+
+	bool attachSharedAudio(AEffect *a, const std::string &name, const uint32_t maxFrames, const uint32_t maxChannels);
+	bool hasSharedAudio() const { return m_sharedAudio != nullptr; }
+
+	// Audio blocks over an AF_UNIX socket instead of protobuf, control calls stay on gRPC
+	bool attachSocketAudio(AEffect *a, const std::string &path, const uint32_t maxFrames);
+	bool hasSocketAudio() const { return m_socketAudio != nullptr; }
+
+	// Pipelined blocks, submitted without waiting and collected oldest first on a later call
+	bool canPipeline() const { return m_sharedAudio != nullptr || m_socketAudio != nullptr; }
+	bool submitBlock(AEffect *a, float **adata, int numInputs, int numOutputs, int frames);
+	bool collectBlock(AEffect *a, float **bdata, int &numOutputs, int &frames);
+
+	// How long a block's reply is waited for before the caller covers it
+	void setBlockDeadline(const uint32_t deadlineMs) { m_blockDeadlineMs = deadlineMs; }
+	uint32_t pendingBlocks() const { return m_pendingCount; }
+
+	static const uint32_t MaxPendingBlocks = SharedAudio::SlotCount;
+
+	// Sizes the reusable block request/reply so the audio path doesn't allocate per block
+	void reserveAudioBuffers(const uint32_t maxFrames, const uint32_t maxChannels);
+
+	// The block messages' arena and payload buffers, none of them move or grow once blocks are flowing
+	struct BlockBuffers {
+		uint64_t arenaBytes;
+		const void *input;
+		const void *output;
+	};
+	BlockBuffers blockBuffers() const;
+
+	bool openAudioStream();
+	void closeAudioStream();
+
+	bool watchParameters();
+	void stopWatchingParameters();
+
 	std::atomic<bool> m_connected{false};
 
+	// Called when the plug-in's I/O configuration or latency changed, with the fields before and after
+	std::function<void(const AEffect &previous, const AEffect &current)> m_effectChangedFunction;
+
+	// Called from the audio thread when a block reports newer fields, it may only wake whoever calls refreshAEffect
+	std::function<void()> m_effectStaleFunction;
+
+	// Called from the watch thread with parameter values pushed by the proxy
+	std::function<void(int numParams, const int *indices, const float *values, int count)> m_parametersChangedFunction;
+
+	// How long the proxy may go without answering a block before it's considered gone
+	static const uint32_t AudioTimeoutMs = 1000;
+	static const uint32_t MaxSocketInFlight = 2 * MaxPendingBlocks;
+
 private:
+	template<typename Reply> void applyAEffect(AEffect *a, const Reply &reply);
+	void markEffectStale();
+	void addInstance(ClientContext &context) const;
+
+	bool processReplacingShared(AEffect *a, float **adata, int numInputs, float **bdata, int numOutputs, int frames);
+	bool processReplacingSocket(AEffect *a, float **adata, int numInputs, float **bdata, int numOutputs, int frames);
+
+	// Tracks the last answered block, turning a long run of misses into a disconnect
+	bool finishBlock(const bool received);
+
+	// Halves of a block round trip, writers return the block's sequence or 0 when it couldn't be sent
+	uint32_t writeSharedBlock(float **adata, int numInputs, int numOutputs, int frames);
+	bool readSharedBlock(const uint32_t sequence, float **bdata, int numOutputs, int frames);
+	uint32_t sendSocketBlock(float **adata, int numInputs, int numOutputs, int frames);
+	bool receiveSocketBlock(const uint32_t sequence, float **bdata, int numOutputs, int frames);
+
+	struct PendingBlock {
+		uint32_t sequence;
+		int numOutputs;
+		int frames;
+	};
+
 	std::unique_ptr<grpc_vst_communicator::Stub> stub_;
+	std::unique_ptr<grpc_vst_communicator::Stub> m_audioStub;
+	uint32_t m_instance{0};
+
+	// Block request and reply live for the whole client in an arena backed by m_arenaBlock. Resetting the arena per block would
+	// drop the payload strings' reserved capacity with them, so the messages are kept and only their fields are overwritten
+	alignas(8) char m_arenaBlock[4096];
+	std::unique_ptr<google::protobuf::Arena> m_arena;
+	grpc_processReplacing_Request *m_blockRequest{nullptr};
+	grpc_processReplacing_Reply *m_blockReply{nullptr};
+	std::unique_ptr<SharedAudio::Ring> m_sharedAudio;
+	uint32_t m_sharedSequence{0};
+	std::unique_ptr<SocketAudio::Socket> m_socketAudio;
+	std::vector<float> m_socketScratch;
+	uint32_t m_socketSequence{0};
+	uint32_t m_socketInFlight{0};
+
+	std::atomic<uint32_t> m_blockDeadlineMs{AudioTimeoutMs};
+	std::chrono::steady_clock::time_point m_lastReply;
+
+	PendingBlock m_pending[MaxPendingBlocks];
+	uint32_t m_pendingHead{0};
+	uint32_t m_pendingCount{0};
+
+	// Generation of the AEffect fields last received from the proxy, 0 before the first snapshot
+	std::atomic<uint32_t> m_generation{0};
+	std::mutex m_generationMutex;
+	std::atomic<bool> m_effectStale{false};
+
+	std::unique_ptr<ClientContext> m_watchContext;
+	std::unique_ptr<ClientReader<grpc_parameterChanges>> m_watchReader;
+	std::thread m_watchThread;
+
+	// Long-lived stream for audio blocks when shared memory is unavailable
+	std::unique_ptr<ClientContext> m_streamContext;
+	std::unique_ptr<ClientReaderWriter<grpc_processReplacing_Request, grpc_processReplacing_Reply>> m_stream;
+
+	// Reads the stream's replies so a block can give up on one at its deadline, counts are of blocks written and replies read
+	std::thread m_streamThread;
+	std::mutex m_streamMutex;
+	std::condition_variable m_streamCondition;
+	uint64_t m_streamSent{0};
+	uint64_t m_streamReceived{0};
+	uint64_t m_streamAwaited{0};
+	bool m_streamReady{false};
+	bool m_streamBroken{false};
 };
@@ -15,50 +15,172 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *****************************************************************************/
-#include "../headers/VSTPlugin.h"
+#include "../headers/ProxyProcess.h"
 
-#include <util/platform.h>
+#include <obs-module.h>
+#include <grpcpp/grpcpp.h>
 
-AEffect *VSTPlugin::loadEffect()
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+extern char **environ;
+
+namespace ProxyProcesses {
+
+// Where the proxy finds the write end of its report pipe
+static const int ReportFd = 3;
+
+// Reads the proxy's ports until it reports them, exits or runs out of time
+static bool readPorts(const int reportFd, ProxyProcess &proxy)
 {
-	AEffect *plugin = nullptr;
-
-	soHandle = os_dlopen(pluginPath.c_str());
-	if (soHandle == nullptr) {
-		blog(LOG_WARNING,
-		     "Failed trying to load VST from '%s',"
-		     "error %d\n",
-		     pluginPath.c_str(), errno);
-		return nullptr;
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ReportTimeoutMs);
+	std::string report;
+
+	while (report.find('\n') == std::string::npos) {
+		const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		pollfd fds[] = {{reportFd, POLLIN, 0}};
+
+		if (remaining <= 0)
+			return false;
+
+		const int ready = poll(fds, 1, int(remaining));
+
+		if (ready < 0 && errno == EINTR)
+			continue;
+
+		if (ready <= 0)
+			return false;
+
+		char buffer[64];
+		const ssize_t length = read(reportFd, buffer, sizeof(buffer));
+
+		if (length < 0 && errno == EINTR)
+			continue;
+
+		// The proxy exited without reporting
+		if (length <= 0)
+			return false;
+
+		report.append(buffer, size_t(length));
 	}
 
-	vstPluginMain mainEntryPoint;
+	return takePorts(report, proxy);
+}
+
+std::shared_ptr<ProxyProcess> start(const std::string &modulePath)
+{
+	const char *module_path = obs_get_module_binary_path(obs_current_module());
+	if (!module_path)
+		return nullptr;
 
-	mainEntryPoint = (vstPluginMain)os_dlsym(soHandle, "VSTPluginMain");
+	// Close on exec, no other process started meanwhile holds it open. The proxy gets the write end as descriptor 3
+	int report[2];
 
-	if (mainEntryPoint == nullptr) {
-		mainEntryPoint = (vstPluginMain)os_dlsym(soHandle, "VstPluginMain()");
+	if (pipe2(report, O_CLOEXEC) != 0) {
+		blog(LOG_ERROR, "VST Plug-in: can't create the proxy's report pipe, errno = %d", errno);
+		return nullptr;
 	}
 
-	if (mainEntryPoint == nullptr) {
-		mainEntryPoint = (vstPluginMain)os_dlsym(soHandle, "main");
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, report[1], ReportFd);
+
+	const std::string process_path = (std::filesystem::path(module_path).remove_filename() / "linux-streamlabs-vst").string();
+	const std::string owner = std::to_string(getpid());
+	const std::string reportFd = std::to_string(ReportFd);
+
+	// An empty module path starts a proxy without instances, waiting for createInstance. Port 0 lets the proxy bind any free one
+	char *argv[] = {(char *)"linux-streamlabs-vst", (char *)modulePath.c_str(), (char *)"0", (char *)owner.c_str(), (char *)"0", (char *)reportFd.c_str(),
+			nullptr};
+
+	pid_t pid = -1;
+	const int error = posix_spawn(&pid, process_path.c_str(), &actions, nullptr, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(report[1]);
+
+	if (error != 0) {
+		blog(LOG_ERROR, "VST Plug-in: can't start vst server '%s', error = %d", process_path.c_str(), error);
+		close(report[0]);
+		return nullptr;
 	}
 
-	if (mainEntryPoint == nullptr) {
-		blog(LOG_WARNING, "Couldn't get a pointer to plug-in's main()");
+	auto proxy = std::make_shared<ProxyProcess>();
+	proxy->pid = pid;
+
+	const bool reported = readPorts(report[0], *proxy);
+	close(report[0]);
+
+	if (!reported) {
+		blog(LOG_ERROR, "VST Plug-in: vst server '%s' didn't report its ports", process_path.c_str());
+		kill(*proxy);
 		return nullptr;
 	}
 
-	// Instantiate the plug-in
-	plugin = mainEntryPoint(hostCallback_static);
-	plugin->user = this;
-	return plugin;
+	openChannels(*proxy);
+	return proxy;
 }
 
-void VSTPlugin::unloadLibrary()
+bool isRunning(ProxyProcess &proxy)
 {
-	if (soHandle) {
-		os_dlclose(soHandle);
-		soHandle = nullptr;
-	}
+	pid_t pid = proxy.pid;
+
+	if (pid <= 0)
+		return false;
+
+	// Reaps it as soon as it is gone, the pid may be reused after that
+	if (waitpid(pid, nullptr, WNOHANG) == 0)
+		return true;
+
+	proxy.pid.compare_exchange_strong(pid, -1);
+	return false;
+}
+
+void end(ProxyProcess &proxy, const int waitMs)
+{
+	const pid_t pid = proxy.pid.exchange(-1);
+
+	if (pid <= 0)
+		return;
+
+	std::thread(
+		[](pid_t pid, int waitMs) {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
+
+			// Might have to kill it, wait a moment but note that wait time is 0 if tcp connection already isn't valid
+			while (waitpid(pid, nullptr, WNOHANG) == 0) {
+				if (std::chrono::steady_clock::now() >= deadline) {
+					if (::kill(pid, SIGKILL) != 0)
+						blog(LOG_ERROR, "VST Plug-in: process is stuck somehow cannot terminate, errno = %d", errno);
+
+					waitpid(pid, nullptr, 0);
+					return;
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		},
+		pid, waitMs)
+		.detach();
+}
+
+void kill(ProxyProcess &proxy)
+{
+	const pid_t pid = proxy.pid.exchange(-1);
+
+	if (pid <= 0)
+		return;
+
+	::kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+}
+
 }
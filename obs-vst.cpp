@@ -24,16 +24,43 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <util/dstr.h>
 
 #include "headers/VSTPlugin.h"
+#include "headers/ProxyProcess.h"
+#include "headers/AudioKernels.h"
 
 #define OPEN_VST_SETTINGS "open_vst_settings"
 #define CLOSE_VST_SETTINGS "close_vst_settings"
 #define OPEN_WHEN_ACTIVE_VST_SETTINGS "open_when_active_vst_settings"
+#define PIPELINED_VST_SETTINGS "pipelined_vst_settings"
+#define REBLOCK_VST_SETTINGS "reblock_vst_settings"
+#define DEADLINE_VST_SETTINGS "deadline_blocks_vst_settings"
+#define PROXY_MODE_VST_SETTINGS "proxy_mode_vst_settings"
+#define PROXY_GROUP_VST_SETTINGS "proxy_group_vst_settings"
+#define SILENCE_GATE_VST_SETTINGS "silence_gate_vst_settings"
+#define SILENCE_TAIL_VST_SETTINGS "silence_tail_ms_vst_settings"
+#define ADAPTIVE_BLOCKS_VST_SETTINGS "adaptive_blocks_vst_settings"
+#define BLOCK_TARGET_VST_SETTINGS "block_target_ms_vst_settings"
+#define ROUTING_INPUTS_VST_SETTINGS "routing_inputs_vst_settings"
+#define ROUTING_OUTPUTS_VST_SETTINGS "routing_outputs_vst_settings"
 #define SAVE_VST_TEXT obs_module_text("Save")
 
 #define PLUG_IN_NAME obs_module_text("VstPlugin")
 #define OPEN_VST_TEXT obs_module_text("OpenPluginInterface")
 #define CLOSE_VST_TEXT obs_module_text("ClosePluginInterface")
 #define OPEN_WHEN_ACTIVE_VST_TEXT obs_module_text("OpenInterfaceWhenActive")
+#define PIPELINED_VST_TEXT obs_module_text("PipelinedProcessing")
+#define REBLOCK_VST_TEXT obs_module_text("FullBlocks")
+#define DEADLINE_VST_TEXT obs_module_text("BlockDeadline")
+#define PROXY_MODE_VST_TEXT obs_module_text("ProxyMode")
+#define PROXY_GROUP_VST_TEXT obs_module_text("ProxyGroup")
+#define SILENCE_GATE_VST_TEXT obs_module_text("SilenceGate")
+#define SILENCE_TAIL_VST_TEXT obs_module_text("SilenceTail")
+#define ADAPTIVE_BLOCKS_VST_TEXT obs_module_text("AdaptiveBlocks")
+#define BLOCK_TARGET_VST_TEXT obs_module_text("BlockTarget")
+#define ROUTING_INPUTS_VST_TEXT obs_module_text("RoutingInputs")
+#define ROUTING_OUTPUTS_VST_TEXT obs_module_text("RoutingOutputs")
+
+// Which filters share a proxy process, a crash only takes down the filters in the same process
+enum ProxyMode { ProxySeparate = 0, ProxyPerPlugin = 1, ProxyPerGroup = 2 };
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE("obs-vst", "en-US")
@@ -80,21 +107,51 @@ static const char *vst_name(void *unused)
 static void vst_destroy(void *data)
 {
 	VSTPlugin *vstPlugin = (VSTPlugin *)data;
+	vstPlugin->beginDestroy();
 	vstPlugin->closeEditor();
 	vstPlugin->unloadEffect();
 	delete vstPlugin;
 }
 
+static void vst_filter_remove(void *data, obs_source_t *parent)
+{
+	UNUSED_PARAMETER(parent);
+
+	VSTPlugin *vstPlugin = (VSTPlugin *)data;
+	vstPlugin->unwatchParent();
+}
+
 static void vst_update(void *data, obs_data_t *settings)
 {
 	VSTPlugin *vstPlugin = (VSTPlugin *)data;
 
 	vstPlugin->setOpenInterfaceWhenActive(obs_data_get_bool(settings, OPEN_WHEN_ACTIVE_VST_SETTINGS));
+	vstPlugin->setPipelined(obs_data_get_bool(settings, PIPELINED_VST_SETTINGS));
+	vstPlugin->setReblocking(obs_data_get_bool(settings, REBLOCK_VST_SETTINGS));
+	vstPlugin->setDeadlineBlocks(obs_data_get_double(settings, DEADLINE_VST_SETTINGS));
+	vstPlugin->setSilenceGate(obs_data_get_bool(settings, SILENCE_GATE_VST_SETTINGS), uint32_t(obs_data_get_int(settings, SILENCE_TAIL_VST_SETTINGS)));
+	vstPlugin->setAdaptiveBlocks(obs_data_get_bool(settings, ADAPTIVE_BLOCKS_VST_SETTINGS), obs_data_get_double(settings, BLOCK_TARGET_VST_SETTINGS));
+	vstPlugin->setChannelRouting(obs_data_get_string(settings, ROUTING_INPUTS_VST_SETTINGS), obs_data_get_string(settings, ROUTING_OUTPUTS_VST_SETTINGS));
 	const char *path = obs_data_get_string(settings, "plugin_path");
 
 	if (!path || !strcmp(path, ""))
 		return;
 
+	// Takes effect the next time the plug-in is loaded
+	switch (obs_data_get_int(settings, PROXY_MODE_VST_SETTINGS)) {
+	case ProxyPerPlugin:
+		vstPlugin->setProxyGroup(std::string("binary:") + path);
+		break;
+	case ProxyPerGroup: {
+		const char *group = obs_data_get_string(settings, PROXY_GROUP_VST_SETTINGS);
+		vstPlugin->setProxyGroup(group != nullptr && *group != '\0' ? std::string("group:") + group : std::string());
+		break;
+	}
+	default:
+		vstPlugin->setProxyGroup(std::string());
+		break;
+	}
+
 	bool load_vst = false;
 
 	if (!vstPlugin->isProxyDisconnected()) {
@@ -106,6 +163,8 @@ static void vst_update(void *data, obs_data_t *settings)
 	if (load_vst) {
 		const bool openWindow = vstPlugin->hasWindowOpen();
 
+		// A restart of the previous plug-in must not race this load
+		vstPlugin->cancelRestart();
 		vstPlugin->unloadEffect();
 		vstPlugin->loadEffectFromPath(path);
 
@@ -213,6 +272,14 @@ static void vst_save(void *data, obs_data_t *settings)
 	obs_data_set_string(settings, "chunk_data_path_v3", path);
 }
 
+static void vst_defaults(obs_data_t *settings)
+{
+	obs_data_set_default_double(settings, DEADLINE_VST_SETTINGS, 2.0);
+	obs_data_set_default_bool(settings, SILENCE_GATE_VST_SETTINGS, false);
+	obs_data_set_default_int(settings, SILENCE_TAIL_VST_SETTINGS, 1000);
+	obs_data_set_default_double(settings, BLOCK_TARGET_VST_SETTINGS, 5.0);
+}
+
 static struct obs_audio_data *vst_filter_audio(void *data, struct obs_audio_data *audio)
 {
 	VSTPlugin *vstPlugin = (VSTPlugin *)data;
@@ -317,15 +384,17 @@ static void fill_out_plugins(obs_property_t *list)
 	std::vector<std::string> dir_list = win32_build_dir_list();
 
 #elif __linux__
+	std::vector<std::string> dir_list;
+
 	char *vstPathEnv = getenv("VST_PATH");
 	if (vstPathEnv != nullptr) {
-		std::string dir_list[] = {vstPathEnv};
+		dir_list = {vstPathEnv};
 	} else {
 		/* FIXME: Platform dependent areas.
 		   Should use environment variables */
-		std::vector<std::string> dir_list({"/usr/lib/vst/", "/usr/lib/lxvst/", "/usr/lib/linux_vst/", "/usr/lib64/vst/", "/usr/lib64/lxvst/",
-						   "/usr/lib64/linux_vst/", "/usr/local/lib/vst/", "/usr/local/lib/lxvst/", "/usr/local/lib/linux_vst/",
-						   "/usr/local/lib64/vst/", "/usr/local/lib64/lxvst/", "/usr/local/lib64/linux_vst/", "~/.vst/", "~/.lxvst/"});
+		dir_list = {"/usr/lib/vst/", "/usr/lib/lxvst/", "/usr/lib/linux_vst/", "/usr/lib64/vst/", "/usr/lib64/lxvst/", "/usr/lib64/linux_vst/",
+			    "/usr/local/lib/vst/", "/usr/local/lib/lxvst/", "/usr/local/lib/linux_vst/", "/usr/local/lib64/vst/", "/usr/local/lib64/lxvst/",
+			    "/usr/local/lib64/linux_vst/", "~/.vst/", "~/.lxvst/"};
 	}
 #endif
 
@@ -386,6 +455,28 @@ static obs_properties_t *vst_properties(void *data)
 	obs_property_set_modified_callback(open_button, open_btn_changed);
 
 	obs_properties_add_bool(props, OPEN_WHEN_ACTIVE_VST_SETTINGS, OPEN_WHEN_ACTIVE_VST_TEXT);
+	obs_properties_add_bool(props, PIPELINED_VST_SETTINGS, PIPELINED_VST_TEXT);
+	obs_properties_add_bool(props, REBLOCK_VST_SETTINGS, REBLOCK_VST_TEXT);
+	obs_properties_add_float_slider(props, DEADLINE_VST_SETTINGS, DEADLINE_VST_TEXT, 0.5, 8.0, 0.5);
+	obs_properties_add_bool(props, SILENCE_GATE_VST_SETTINGS, SILENCE_GATE_VST_TEXT);
+
+	obs_property_t *silence_tail = obs_properties_add_int_slider(props, SILENCE_TAIL_VST_SETTINGS, SILENCE_TAIL_VST_TEXT, 0, 10000, 100);
+	obs_property_int_set_suffix(silence_tail, " ms");
+
+	obs_properties_add_bool(props, ADAPTIVE_BLOCKS_VST_SETTINGS, ADAPTIVE_BLOCKS_VST_TEXT);
+
+	obs_property_t *block_target = obs_properties_add_float_slider(props, BLOCK_TARGET_VST_SETTINGS, BLOCK_TARGET_VST_TEXT, 1.0, 20.0, 0.5);
+	obs_property_float_set_suffix(block_target, " ms");
+
+	obs_properties_add_text(props, ROUTING_INPUTS_VST_SETTINGS, ROUTING_INPUTS_VST_TEXT, OBS_TEXT_DEFAULT);
+	obs_properties_add_text(props, ROUTING_OUTPUTS_VST_SETTINGS, ROUTING_OUTPUTS_VST_TEXT, OBS_TEXT_DEFAULT);
+
+	obs_property_t *proxy_mode =
+		obs_properties_add_list(props, PROXY_MODE_VST_SETTINGS, PROXY_MODE_VST_TEXT, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(proxy_mode, obs_module_text("ProxyMode.Separate"), ProxySeparate);
+	obs_property_list_add_int(proxy_mode, obs_module_text("ProxyMode.PerPlugin"), ProxyPerPlugin);
+	obs_property_list_add_int(proxy_mode, obs_module_text("ProxyMode.PerGroup"), ProxyPerGroup);
+	obs_properties_add_text(props, PROXY_GROUP_VST_SETTINGS, PROXY_GROUP_VST_TEXT, OBS_TEXT_DEFAULT);
 
 	UNUSED_PARAMETER(data);
 
@@ -403,9 +494,18 @@ bool obs_module_load(void)
 	vst_filter.destroy = vst_destroy;
 	vst_filter.update = vst_update;
 	vst_filter.filter_audio = vst_filter_audio;
+	vst_filter.filter_remove = vst_filter_remove;
 	vst_filter.get_properties = vst_properties;
 	vst_filter.save = vst_save;
+	vst_filter.get_defaults = vst_defaults;
 
 	obs_register_source(&vst_filter);
+
+	blog(LOG_INFO, "VST Plug-in: audio kernels use %s", AudioKernels::instructionSet());
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	ProxyProcesses::stopSpare();
+}
@@ -0,0 +1,189 @@
+#include "AudioThread.h"
+#include "ProxyLog.h"
+
+#ifdef WIN32
+#include <avrt.h>
+#else
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OBS_VST_MXCSR 1
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+AudioThread::~AudioThread()
+{
+	stop();
+}
+
+void AudioThread::start()
+{
+	if (m_running)
+		return;
+
+	m_stop = false;
+	m_sleeping = false;
+	m_thread = std::thread(&AudioThread::loop, this);
+	m_threadId = m_thread.get_id();
+	m_running = true;
+}
+
+void AudioThread::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+
+	// A producer that saw the thread running finishes its push first, so nothing is left behind in the queue
+	while (m_submitting > 0)
+		std::this_thread::yield();
+
+	m_stop = true;
+	m_wakeup.post();
+	m_thread.join();
+}
+
+bool AudioThread::submit(void (*run)(void *context), void *context)
+{
+	// One per producer thread, a producer only ever waits on its own job
+	static thread_local Semaphore completion;
+
+	if (!push({run, context, &completion}))
+		return false;
+
+	completion.wait();
+	return true;
+}
+
+void AudioThread::post(void (*run)(void *context), void *context)
+{
+	if (!push({run, context, nullptr}))
+		run(context);
+}
+
+bool AudioThread::push(const Job &job)
+{
+	m_submitting++;
+
+	if (!m_running || std::this_thread::get_id() == m_threadId || !m_jobs.push(job)) {
+		m_submitting--;
+		return false;
+	}
+
+	// Pairs with the fence in loop(), either this sees the thread going to sleep or the thread sees the job
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (m_sleeping.exchange(false))
+		m_wakeup.post();
+
+	m_submitting--;
+	return true;
+}
+
+void AudioThread::loop()
+{
+	RealtimeScope realtime("vst-audio");
+
+	auto execute = [](Job &job) {
+		job.run(job.context);
+
+		if (job.completion != nullptr)
+			job.completion->post();
+	};
+
+	for (;;) {
+		Job job;
+
+		while (m_jobs.pop(job))
+			execute(job);
+
+		m_sleeping = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		// Pushed before the flag was visible, that producer didn't post
+		if (m_jobs.pop(job)) {
+			m_sleeping = false;
+			execute(job);
+			continue;
+		}
+
+		// Stopping waits for producers to finish pushing, so an empty queue here stays empty
+		if (m_stop)
+			break;
+
+		// A post left over from a producer that raced the check above only makes this return early
+		m_wakeup.wait();
+		m_sleeping = false;
+	}
+}
+
+RealtimeScope::RealtimeScope(const char *name)
+{
+#ifdef OBS_VST_MXCSR
+	// Flush to zero and denormals are zero, a decaying tail otherwise costs many times more per sample
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+
+#ifdef WIN32
+	(void)name;
+
+	// MMCSS schedules audio threads ahead of normal work without starving the system, plain time critical is the fallback
+	DWORD taskIndex = 0;
+	m_mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+
+	if (m_mmcss != NULL)
+		AvSetMmThreadPriority(m_mmcss, AVRT_PRIORITY_HIGH);
+	else
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+	pthread_setname_np(pthread_self(), name);
+
+	sched_param param = {};
+	param.sched_priority = std::min(sched_get_priority_min(SCHED_FIFO) + Priority, sched_get_priority_max(SCHED_FIFO));
+	const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	// Needs CAP_SYS_NICE or an RLIMIT_RTPRIO grant, a lower nice value is the next best thing. Every transport thread gets here, report it once
+	if (error != 0) {
+		static std::atomic<bool> reported{false};
+		const bool report = !reported.exchange(true);
+
+		if (report)
+			proxyLog("no real-time scheduling for %s: %s", name, strerror(error));
+
+		if (setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), -10) != 0 && report)
+			proxyLog("%s keeps its priority: %s", name, strerror(errno));
+	}
+
+	// Always tried. Locking future mappings as well would fail allocations past a finite RLIMIT_MEMLOCK, then only what's mapped now is locked
+	rlimit limit = {};
+	const bool unlimited = getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY;
+
+	if (mlockall(unlimited ? MCL_CURRENT | MCL_FUTURE : MCL_CURRENT) != 0) {
+		static std::atomic<bool> reported{false};
+
+		if (!reported.exchange(true))
+			proxyLog("memory stays pageable: %s", strerror(errno));
+	}
+#endif
+
+	// Fault the stack in now rather than during the first block, plug-ins can use a lot of it
+	volatile char stack[256 * 1024];
+	memset(const_cast<char *>(stack), 0, sizeof(stack));
+}
+
+RealtimeScope::~RealtimeScope()
+{
+#ifdef WIN32
+	if (m_mmcss != NULL)
+		AvRevertMmThreadCharacteristics(m_mmcss);
+#endif
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+#include "CommandQueue.h"
+#include "../headers/Semaphore.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+
+/*
+ * Gives the calling thread audio priority, flushes its denormals and locks
+ * memory for as long as it lives. The audio thread holds one, and so does
+ * every shared memory and socket transport thread, which waits on its ring or
+ * socket itself and runs the block right there without a handoff.
+ */
+class RealtimeScope {
+public:
+	explicit RealtimeScope(const char *name);
+	~RealtimeScope();
+
+	RealtimeScope(const RealtimeScope &) = delete;
+	RealtimeScope &operator=(const RealtimeScope &) = delete;
+
+	// Above the lowest SCHED_FIFO priority, below the kernel's own threads
+	static const int Priority = 10;
+
+private:
+#ifdef WIN32
+	HANDLE m_mmcss{NULL};
+#endif
+};
+
+/*
+ * The real-time thread for blocks that arrive over gRPC. The callbacks hand
+ * it their block through a lock-free queue and wait for the result, or post it
+ * with the reply to send once done, so DSP lands on a warm thread with raised
+ * priority and denormals flushed, never on whichever gRPC thread took the
+ * call. Wakeups in both directions are semaphore posts, the audio thread never
+ * takes a lock a producer could hold.
+ */
+class AudioThread {
+public:
+	AudioThread() = default;
+	~AudioThread();
+
+	void start();
+
+	// Runs what is still queued, later work runs on the caller's thread
+	void stop();
+
+	// Returns once work has run on the audio thread, or on this one when the audio thread isn't running or is the caller
+	template<typename Work> void run(Work &&work)
+	{
+		using Callable = std::remove_reference_t<Work>;
+		void *context = const_cast<void *>(static_cast<const void *>(std::addressof(work)));
+
+		if (!submit([](void *context) { (*static_cast<Callable *>(context))(); }, context))
+			work();
+	}
+
+	// Queues run and returns right away, run then finishes the caller's work itself. Runs inline when it can't be queued
+	void post(void (*run)(void *context), void *context);
+
+	// Producers wait on their own job and calls post one block at a time, so this is only ever full with more callers than cells
+	static const size_t Capacity = 64;
+
+private:
+	struct Job {
+		void (*run)(void *context);
+		void *context;
+		// Null for posted work, nobody waits on it
+		Semaphore *completion;
+	};
+
+	bool submit(void (*run)(void *context), void *context);
+	bool push(const Job &job);
+	void loop();
+
+	MultiProducerQueue<Job, Capacity> m_jobs;
+
+	std::thread m_thread;
+	std::thread::id m_threadId;
+	std::atomic<bool> m_running{false};
+	std::atomic<int> m_submitting{0};
+
+	// Set while the thread is about to wait, producers only post the semaphore then, so a busy thread costs them no system call
+	Semaphore m_wakeup;
+	std::atomic<bool> m_sleeping{false};
+	std::atomic<bool> m_stop{false};
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Fixed capacity single-producer/single-consumer queue for commands to the
+ * proxy's main thread. Neither side takes a lock, waking the consumer is up
+ * to the caller, which signals its own wait primitive after a push.
+ */
+template<typename T, size_t Capacity> class CommandQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	// Producer side, false when full
+	bool push(const T &item)
+	{
+		const size_t write = m_write.load(std::memory_order_relaxed);
+
+		if (write - m_read.load(std::memory_order_acquire) == Capacity)
+			return false;
+
+		m_items[write & (Capacity - 1)] = item;
+		m_write.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, false when empty
+	bool pop(T &item)
+	{
+		const size_t read = m_read.load(std::memory_order_relaxed);
+
+		if (read == m_write.load(std::memory_order_acquire))
+			return false;
+
+		item = m_items[read & (Capacity - 1)];
+		m_read.store(read + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	static const size_t CacheLine = 64;
+
+	T m_items[Capacity];
+	alignas(CacheLine) std::atomic<size_t> m_write{0};
+	alignas(CacheLine) std::atomic<size_t> m_read{0};
+};
+
+/*
+ * Fixed capacity queue for any number of producers and one consumer, after
+ * Vyukov's bounded queue. Each cell's sequence tells a producer whether the
+ * cell is free for its ticket, so producers claim cells without a lock.
+ */
+template<typename T, size_t Capacity> class MultiProducerQueue {
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	MultiProducerQueue()
+	{
+		for (size_t i = 0; i < Capacity; i++)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	// Any thread, false when full
+	bool push(const T &item)
+	{
+		size_t write = m_write.load(std::memory_order_relaxed);
+		Cell *cell;
+
+		for (;;) {
+			cell = &m_cells[write & (Capacity - 1)];
+			const ptrdiff_t lag = ptrdiff_t(cell->sequence.load(std::memory_order_acquire)) - ptrdiff_t(write);
+
+			if (lag == 0 && m_write.compare_exchange_weak(write, write + 1, std::memory_order_relaxed))
+				break;
+
+			if (lag < 0)
+				return false;
+
+			if (lag > 0)
+				write = m_write.load(std::memory_order_relaxed);
+		}
+
+		cell->item = item;
+		cell->sequence.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, false when empty
+	bool pop(T &item)
+	{
+		const size_t read = m_read.load(std::memory_order_relaxed);
+		Cell &cell = m_cells[read & (Capacity - 1)];
+
+		if (cell.sequence.load(std::memory_order_acquire) != read + 1)
+			return false;
+
+		item = cell.item;
+		m_read.store(read + 1, std::memory_order_relaxed);
+		cell.sequence.store(read + Capacity, std::memory_order_release);
+		return true;
+	}
+
+private:
+	static const size_t CacheLine = 64;
+
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	Cell m_cells[Capacity];
+	alignas(CacheLine) std::atomic<size_t> m_write{0};
+	alignas(CacheLine) std::atomic<size_t> m_read{0};
+};
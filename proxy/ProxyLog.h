@@ -0,0 +1,27 @@
+#pragma once
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+#include <cstdarg>
+#include <cstdio>
+
+// The proxy's diagnostics. Linux proxies share the host's stderr, on Windows the proxy has no console so they go to the debugger output
+static inline void proxyLog(const char *format, ...)
+{
+	char message[512];
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+#ifdef WIN32
+	char line[sizeof(message) + 16];
+	snprintf(line, sizeof(line), "VST proxy: %s\n", message);
+	OutputDebugStringA(line);
+#else
+	fprintf(stderr, "VST proxy: %s\n", message);
+#endif
+}
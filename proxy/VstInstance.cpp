@@ -0,0 +1,738 @@
+#include "VstInstance.h"
+#include "AudioThread.h"
+#include "ProxyLog.h"
+
+#include "../vst_header/aeffectx.h"
+#include "../headers/SharedAudioRing.h"
+#include "../headers/SocketAudioTransport.h"
+
+#ifndef WIN32
+#include <dlfcn.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+VstInstance::VstInstance(const uint32_t id, const std::wstring &modulePath) : m_id(id), m_modulePath(modulePath)
+{
+}
+
+VstInstance::~VstInstance()
+{
+	close();
+
+#ifdef WIN32
+	if (m_dllHandle != NULL)
+		::FreeLibrary(m_dllHandle);
+#else
+	if (m_dllHandle != nullptr)
+		dlclose(m_dllHandle);
+#endif
+}
+
+bool VstInstance::load()
+{
+	typedef AEffect *(*vstPluginMain)(audioMasterCallback audioMaster);
+
+	// Instances of the same binary share the module, LoadLibrary and dlopen only count references
+#ifdef WIN32
+	::SetDllDirectoryW(std::filesystem::path(m_modulePath).remove_filename().c_str());
+	m_dllHandle = ::LoadLibraryW(m_modulePath.c_str());
+	::SetDllDirectoryW(nullptr);
+
+	if (m_dllHandle == NULL)
+		return false;
+
+	auto symbol = [this](const char *name) { return (vstPluginMain)GetProcAddress(m_dllHandle, name); };
+#else
+	m_dllHandle = dlopen(std::filesystem::path(m_modulePath).string().c_str(), RTLD_NOW | RTLD_LOCAL);
+
+	if (m_dllHandle == nullptr) {
+		proxyLog("%s", dlerror());
+		return false;
+	}
+
+	auto symbol = [this](const char *name) { return (vstPluginMain)dlsym(m_dllHandle, name); };
+#endif
+
+	vstPluginMain mainEntryPoint = symbol("VSTPluginMain");
+
+	if (mainEntryPoint == nullptr)
+		mainEntryPoint = symbol("VstPluginMain()");
+
+	if (mainEntryPoint == nullptr)
+		mainEntryPoint = symbol("main");
+
+	if (mainEntryPoint == nullptr)
+		return false;
+
+	// Instantiate the plug-in
+	m_effect = mainEntryPoint([](AEffect *effect, int32_t opcode, int32_t index, intptr_t /*value*/, void * /*ptr*/, float opt) {
+		// hostCallback
+		if (effect && effect->user != nullptr) {
+			intptr_t result = 0;
+
+			switch (opcode) {
+			case audioMasterSizeWindow:
+				return static_cast<intptr_t>(0);
+			case audioMasterAutomate:
+				static_cast<VstInstance *>(effect->user)->onParameterAutomated(index, opt);
+				return static_cast<intptr_t>(0);
+			case audioMasterIOChanged:
+				// The new I/O and delay reach the host with the next reply's generation
+				static_cast<VstInstance *>(effect->user)->refreshGeneration();
+				return static_cast<intptr_t>(1);
+			}
+
+			return result;
+		}
+
+		switch (opcode) {
+		case audioMasterVersion:
+			return static_cast<intptr_t>(2400);
+		default:
+			return static_cast<intptr_t>(0);
+		}
+	});
+
+	if (m_effect == nullptr)
+		return false;
+
+	m_effect->user = this;
+	return true;
+}
+
+void VstInstance::close()
+{
+	m_closed = true;
+	stopSharedAudio();
+	stopSocketAudio();
+	stopParameterWatch();
+	setChain({});
+
+	// The module's watch thread finishes this instance's watch once woken
+	if (m_parametersPendingFunction)
+		m_parametersPendingFunction();
+
+	// Waits out a chain that is running this instance as one of its stages
+	std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+}
+
+bool VstInstance::processBlock(const grpc_processReplacing_Request *request, grpc_processReplacing_Reply *reply)
+{
+	const int frames = request->frames();
+	const int numInputs = std::min(request->arraysize(), int(request->adata().size() / (std::max(frames, 1) * sizeof(float))));
+	const int numOutputs = request->outputsize();
+
+	{
+		std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+
+		// A block queued before effClose runs after close() has returned, the effect may already be gone
+		if (m_closed)
+			return false;
+
+		// The plug-in always gets as many buffers as it declares, the ones the host didn't send stay silent
+		const int inputCount = std::max(numInputs, m_effect->numInputs);
+		const int outputCount = std::max(numOutputs, m_effect->numOutputs);
+
+		m_bufferPool.reserve(frames, inputCount, outputCount);
+
+		float **adata = m_bufferPool.inputs();
+		float **bdata = m_bufferPool.outputs();
+
+		const char *input = request->adata().data();
+
+		for (int c = 0; c < inputCount; c++) {
+			if (c < numInputs)
+				memcpy(adata[c], input + size_t(c) * frames * sizeof(float), frames * sizeof(float));
+			else
+				memset(adata[c], 0, frames * sizeof(float));
+		}
+
+		for (int c = 0; c < outputCount; c++)
+			memset(bdata[c], 0, frames * sizeof(float));
+
+		m_effect->processReplacing(m_effect, adata, bdata, frames);
+		scanParameters(ParameterScanSlice);
+		runChain(bdata, outputCount, numOutputs, frames);
+
+		std::string *output = reply->mutable_bdata();
+		output->resize(size_t(numOutputs) * frames * sizeof(float));
+
+		for (int c = 0; c < numOutputs; c++)
+			memcpy(&(*output)[size_t(c) * frames * sizeof(float)], bdata[c], frames * sizeof(float));
+	}
+
+	reply->set_frames(frames);
+	reply->set_arraysize(numOutputs);
+
+	setAEffect(request->generation(), reply);
+	return true;
+}
+
+bool VstInstance::setChain(std::vector<std::shared_ptr<VstInstance>> stages)
+{
+	// Checked and swapped one chain at a time, so no two chains can each pass the check for the other
+	static std::mutex chainsMutex;
+
+	std::shared_ptr<const std::vector<std::shared_ptr<VstInstance>>> chain;
+	std::lock_guard<std::mutex> chains(chainsMutex);
+
+	for (const std::shared_ptr<VstInstance> &stage : stages) {
+		const bool fits = std::max(stage->m_effect->numInputs, stage->m_effect->numOutputs) <= MaxChainChannels;
+
+		if (!fits || stage->m_closed || stage->chainReaches(this)) {
+			stages.clear();
+			break;
+		}
+	}
+
+	const bool chained = !stages.empty();
+
+	if (chained)
+		chain = std::make_shared<const std::vector<std::shared_ptr<VstInstance>>>(std::move(stages));
+
+	// Waits out a block running the old chain, and the old chain is released once both locks are, it may hold the last reference to
+	// a closed instance
+	std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+
+	if (chained)
+		m_chainPool.reserve(m_bufferPool.frames(), MaxChainChannels, MaxChainChannels);
+
+	std::lock_guard<std::mutex> lck(m_chainMutex);
+	m_chain.swap(chain);
+	return chained;
+}
+
+bool VstInstance::chainReaches(const VstInstance *instance)
+{
+	if (this == instance)
+		return true;
+
+	std::shared_ptr<const std::vector<std::shared_ptr<VstInstance>>> chain;
+
+	{
+		std::lock_guard<std::mutex> grd(m_chainMutex);
+		chain = m_chain;
+	}
+
+	if (chain == nullptr)
+		return false;
+
+	for (const std::shared_ptr<VstInstance> &stage : *chain) {
+		if (stage->chainReaches(instance))
+			return true;
+	}
+
+	return false;
+}
+
+void VstInstance::reserveBuffers(const int frames)
+{
+	std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+	m_bufferPool.reserve(frames, m_effect->numInputs, m_effect->numOutputs);
+
+	std::lock_guard<std::mutex> lck(m_chainMutex);
+
+	if (m_chain != nullptr)
+		m_chainPool.reserve(frames, MaxChainChannels, MaxChainChannels);
+}
+
+void VstInstance::runChain(float **outputs, const int outputCount, const int numOutputs, const int frames)
+{
+	std::shared_ptr<const std::vector<std::shared_ptr<VstInstance>>> chain;
+
+	{
+		std::lock_guard<std::mutex> grd(m_chainMutex);
+		chain = m_chain;
+	}
+
+	// Blocks are never longer than the negotiated size the pool was reserved for, the host splits them
+	if (chain == nullptr || frames > m_chainPool.frames())
+		return;
+
+	// Each stage reads the previous one's planes, the two plane sets swap roles instead of copying
+	float **input = m_chainPool.inputs();
+	float **output = m_chainPool.outputs();
+	int channels = std::min(outputCount, MaxChainChannels);
+
+	for (int c = 0; c < channels; c++)
+		memcpy(input[c], outputs[c], frames * sizeof(float));
+
+	for (const std::shared_ptr<VstInstance> &stage : *chain) {
+		// Its filter passes this audio through, so the stage has to run even if a block or call of its own holds the pool for now
+		std::lock_guard<std::mutex> lck(stage->m_bufferPool.mutex());
+
+		// Closing, its filter is unloading the plug-in and can't run it either
+		if (stage->m_closed)
+			continue;
+
+		AEffect *effect = stage->m_effect;
+		const int numInputs = std::max(effect->numInputs, 0);
+		const int stageOutputs = std::max(effect->numOutputs, 0);
+
+		// setChain turns wider plug-ins away, this one grew since. Later stages still run, in order
+		if (numInputs > MaxChainChannels || stageOutputs > MaxChainChannels) {
+			static std::atomic<bool> reported{false};
+
+			if (!reported.exchange(true))
+				proxyLog("chain stage %u is wider than %d channels, its audio passes through unprocessed", stage->m_id, MaxChainChannels);
+
+			continue;
+		}
+
+		for (int c = channels; c < numInputs; c++)
+			memset(input[c], 0, frames * sizeof(float));
+
+		for (int c = 0; c < stageOutputs; c++)
+			memset(output[c], 0, frames * sizeof(float));
+
+		effect->processReplacing(effect, input, output, frames);
+		stage->scanParameters(ParameterScanSlice);
+
+		std::swap(input, output);
+		channels = stageOutputs;
+	}
+
+	// Channels the last stage has no output for are silenced, as for a single plug-in
+	for (int c = 0; c < numOutputs; c++) {
+		if (c < channels)
+			memcpy(outputs[c], input[c], frames * sizeof(float));
+		else
+			memset(outputs[c], 0, frames * sizeof(float));
+	}
+}
+
+uint32_t VstInstance::refreshGeneration()
+{
+	std::lock_guard<std::mutex> grd(m_generationMutex);
+	refreshGenerationLocked();
+	return m_generation;
+}
+
+void VstInstance::refreshGenerationLocked()
+{
+	if (m_generation != 0 && m_snapshot.magic() == m_effect->magic && m_snapshot.numprograms() == m_effect->numPrograms &&
+	    m_snapshot.numparams() == m_effect->numParams && m_snapshot.numinputs() == m_effect->numInputs &&
+	    m_snapshot.numoutputs() == m_effect->numOutputs && m_snapshot.flags() == m_effect->flags &&
+	    m_snapshot.initialdelay() == m_effect->initialDelay && m_snapshot.uniqueid() == m_effect->uniqueID &&
+	    m_snapshot.version() == m_effect->version)
+		return;
+
+	m_snapshot.set_magic(m_effect->magic);
+	m_snapshot.set_numprograms(m_effect->numPrograms);
+	m_snapshot.set_numparams(m_effect->numParams);
+	m_snapshot.set_numinputs(m_effect->numInputs);
+	m_snapshot.set_numoutputs(m_effect->numOutputs);
+	m_snapshot.set_flags(m_effect->flags);
+	m_snapshot.set_initialdelay(m_effect->initialDelay);
+	m_snapshot.set_uniqueid(m_effect->uniqueID);
+	m_snapshot.set_version(m_effect->version);
+	m_generation++;
+}
+
+bool VstInstance::startSharedAudio(const std::string &name)
+{
+	stopSharedAudio();
+
+	auto ring = std::make_unique<SharedAudio::Ring>();
+
+	if (!ring->open(name))
+		return false;
+
+	m_sharedInputs.assign(ring->maxChannels(), nullptr);
+	m_sharedOutputs.assign(ring->maxChannels(), nullptr);
+	m_sharedAudio = std::move(ring);
+	m_sharedAudioStop = false;
+	m_sharedAudioThread = std::thread(&VstInstance::sharedAudioLoop, this);
+	return true;
+}
+
+void VstInstance::stopSharedAudio()
+{
+	m_sharedAudioStop = true;
+
+	if (m_sharedAudio != nullptr)
+		m_sharedAudio->signal(SharedAudio::ToProxy);
+
+	if (m_sharedAudioThread.joinable())
+		m_sharedAudioThread.join();
+
+	m_sharedAudio = nullptr;
+}
+
+void VstInstance::sharedAudioLoop()
+{
+	// The host waits on this thread for every block, it runs them itself at audio priority rather than handing them on
+	RealtimeScope realtime("vst-shm");
+
+	while (!m_sharedAudioStop && !m_closed) {
+		while (SharedAudio::BlockHeader *block = m_sharedAudio->beginRead(SharedAudio::ToProxy)) {
+			SharedAudio::BlockHeader *result = m_sharedAudio->beginWrite(SharedAudio::ToHost);
+
+			// Host stopped reading replies, drop the block rather than overwrite
+			if (result == nullptr) {
+				m_sharedAudio->endRead(SharedAudio::ToProxy);
+				continue;
+			}
+
+			const uint32_t frames = block->frames < m_sharedAudio->maxFrames() ? block->frames : m_sharedAudio->maxFrames();
+			const uint32_t numInputs = block->numInputs < m_sharedAudio->maxChannels() ? block->numInputs : m_sharedAudio->maxChannels();
+			const uint32_t numOutputs = block->numOutputs < m_sharedAudio->maxChannels() ? block->numOutputs : m_sharedAudio->maxChannels();
+
+			// Channels the plug-in declares beyond what the host sent or wants back use scratch planes
+			const uint32_t inputCount = std::max(numInputs, uint32_t(std::max(m_effect->numInputs, 0)));
+			const uint32_t outputCount = std::max(numOutputs, uint32_t(std::max(m_effect->numOutputs, 0)));
+
+			if (m_sharedInputs.size() < inputCount)
+				m_sharedInputs.resize(inputCount);
+
+			if (m_sharedOutputs.size() < outputCount)
+				m_sharedOutputs.resize(outputCount);
+
+			// The ring's planes are read and written in place
+			{
+				std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+				m_bufferPool.reserve(m_sharedAudio->maxFrames(), inputCount, outputCount);
+
+				for (uint32_t c = 0; c < inputCount; c++) {
+					if (c < numInputs) {
+						m_sharedInputs[c] = m_sharedAudio->channel(block, c);
+					} else {
+						m_sharedInputs[c] = m_bufferPool.inputs()[c];
+						memset(m_sharedInputs[c], 0, frames * sizeof(float));
+					}
+				}
+
+				for (uint32_t c = 0; c < outputCount; c++) {
+					m_sharedOutputs[c] = c < numOutputs ? m_sharedAudio->channel(result, c) : m_bufferPool.outputs()[c];
+					memset(m_sharedOutputs[c], 0, frames * sizeof(float));
+				}
+
+				m_effect->processReplacing(m_effect, m_sharedInputs.data(), m_sharedOutputs.data(), frames);
+				scanParameters(ParameterScanSlice);
+				runChain(m_sharedOutputs.data(), int(outputCount), int(numOutputs), int(frames));
+			}
+
+			result->sequence = block->sequence;
+			result->frames = frames;
+			result->numInputs = 0;
+			result->numOutputs = numOutputs;
+			result->flags = 0;
+			result->generation = refreshGeneration();
+
+			m_sharedAudio->endRead(SharedAudio::ToProxy);
+			m_sharedAudio->endWrite(SharedAudio::ToHost);
+		}
+
+		// stopSharedAudio signals the same event, so closing doesn't need a timeout to be noticed
+		m_sharedAudio->wait(SharedAudio::ToProxy);
+	}
+}
+
+bool VstInstance::startSocketAudio(const std::string &path)
+{
+	stopSocketAudio();
+
+	// Listening before the reply goes out, so the host can connect right away
+	auto listener = std::make_unique<SocketAudio::Socket>();
+
+	if (!listener->listen(path))
+		return false;
+
+	m_socketListener = std::move(listener);
+	m_socketAudioStop = false;
+	m_socketAudioThread = std::thread(&VstInstance::socketAudioLoop, this);
+	return true;
+}
+
+void VstInstance::stopSocketAudio()
+{
+	{
+		std::lock_guard<std::mutex> grd(m_socketAudioMutex);
+		m_socketAudioStop = true;
+
+		if (m_socketConnection != nullptr)
+			m_socketConnection->shutdown();
+	}
+
+	// Connecting is the one wakeup a blocked accept gets on every platform, once connected it just waits in the backlog
+	SocketAudio::Socket waker;
+
+	if (m_socketAudioThread.joinable() && m_socketListener != nullptr)
+		waker.connect(m_socketListener->path());
+
+	if (m_socketAudioThread.joinable())
+		m_socketAudioThread.join();
+
+	m_socketListener = nullptr;
+}
+
+void VstInstance::socketAudioLoop()
+{
+	SocketAudio::Socket connection;
+
+	if (!connection.accept(*m_socketListener))
+		return;
+
+	// Same as the shared memory loop, blocks run here at audio priority
+	RealtimeScope realtime("vst-socket");
+
+	{
+		std::lock_guard<std::mutex> grd(m_socketAudioMutex);
+
+		if (m_socketAudioStop || m_closed)
+			return;
+
+		m_socketConnection = &connection;
+	}
+
+	float *outputPlanes[SocketAudio::MaxChannels];
+
+	// Planes travel in and out of these rather than the pool, which is only locked around the processing
+	std::vector<float> received;
+	std::vector<float> sent;
+	std::vector<float *> inputs;
+	std::vector<float *> outputs;
+
+	while (!m_socketAudioStop && !m_closed) {
+		SocketAudio::FrameHeader header;
+
+		// Host closed the connection or sent something we can't frame
+		if (!connection.receiveHeader(header) || header.opcode != SocketAudio::Process || header.frames > SocketAudio::MaxFrames)
+			break;
+
+		const uint32_t frames = header.frames;
+
+		// Channels the plug-in declares beyond what the host sent or wants back are silent
+		const uint32_t inputCount = std::max(SocketAudio::channelSpan(header.channelMask), uint32_t(std::max(m_effect->numInputs, 0)));
+		const uint32_t outputCount = std::max(SocketAudio::channelSpan(header.outputMask), uint32_t(std::max(m_effect->numOutputs, 0)));
+
+		const uint32_t inputSpan = SocketAudio::channelSpan(header.channelMask);
+		const uint32_t outputSpan = SocketAudio::channelSpan(header.outputMask);
+
+		if (received.size() < size_t(inputSpan) * frames)
+			received.resize(size_t(inputSpan) * frames);
+
+		if (sent.size() < size_t(outputSpan) * frames)
+			sent.resize(size_t(outputSpan) * frames);
+
+		if (inputs.size() < inputCount)
+			inputs.resize(inputCount);
+
+		if (outputs.size() < outputCount)
+			outputs.resize(outputCount);
+
+		bool complete = true;
+
+		for (uint32_t c = 0; c < inputSpan && complete; c++) {
+			if (header.channelMask & (1u << c))
+				complete = connection.receive(received.data() + size_t(c) * frames, frames * sizeof(float));
+		}
+
+		if (!complete)
+			break;
+
+		{
+			std::lock_guard<std::mutex> grd(m_bufferPool.mutex());
+			m_bufferPool.reserve(int(frames), int(inputCount), int(outputCount));
+
+			for (uint32_t c = 0; c < inputCount; c++) {
+				if (c < inputSpan && (header.channelMask & (1u << c))) {
+					inputs[c] = received.data() + size_t(c) * frames;
+				} else {
+					inputs[c] = m_bufferPool.inputs()[c];
+					memset(inputs[c], 0, frames * sizeof(float));
+				}
+			}
+
+			for (uint32_t c = 0; c < outputCount; c++) {
+				outputs[c] = c < outputSpan && (header.outputMask & (1u << c)) ? sent.data() + size_t(c) * frames : m_bufferPool.outputs()[c];
+				memset(outputs[c], 0, frames * sizeof(float));
+			}
+
+			m_effect->processReplacing(m_effect, inputs.data(), outputs.data(), frames);
+			scanParameters(ParameterScanSlice);
+			runChain(outputs.data(), int(outputCount), int(outputSpan), int(frames));
+		}
+
+		SocketAudio::FrameHeader result = {};
+		result.opcode = SocketAudio::Processed;
+		result.version = SocketAudio::FrameVersion;
+		result.sequence = header.sequence;
+		result.frames = frames;
+		result.channelMask = header.outputMask;
+		result.generation = refreshGeneration();
+
+		uint32_t planes = 0;
+
+		for (uint32_t c = 0; c < outputSpan; c++) {
+			if (header.outputMask & (1u << c))
+				outputPlanes[planes++] = sent.data() + size_t(c) * frames;
+		}
+
+		if (!connection.sendFrame(result, outputPlanes))
+			break;
+	}
+
+	std::lock_guard<std::mutex> grd(m_socketAudioMutex);
+	m_socketConnection = nullptr;
+}
+
+void AudioBufferPool::reserve(const int frames, const int numInputs, const int numOutputs)
+{
+	const int inputs = std::max(numInputs, 0);
+	const int outputs = std::max(numOutputs, 0);
+
+	if (frames <= m_frames && size_t(inputs) <= m_inputs.size() && size_t(outputs) <= m_outputs.size())
+		return;
+
+	m_frames = std::max(frames, m_frames);
+
+	const size_t newInputs = std::max(size_t(inputs), m_inputs.size());
+	const size_t newOutputs = std::max(size_t(outputs), m_outputs.size());
+
+	// Pad each plane to a multiple of 64 bytes
+	const size_t stride = (size_t(m_frames) + 15) & ~size_t(15);
+
+	m_storage.assign(stride * (newInputs + newOutputs), 0.0f);
+	m_inputs.resize(newInputs);
+	m_outputs.resize(newOutputs);
+
+	for (size_t c = 0; c < newInputs; c++)
+		m_inputs[c] = m_storage.data() + c * stride;
+
+	for (size_t c = 0; c < newOutputs; c++)
+		m_outputs[c] = m_storage.data() + (newInputs + c) * stride;
+}
+
+void VstInstance::startParameterWatch()
+{
+	{
+		std::lock_guard<std::mutex> grd(m_parameterMutex);
+		m_parameterValues.clear();
+		m_parameterDirty.clear();
+		m_parameterDirtyList.clear();
+		m_parameterScanCursor = 0;
+	}
+
+	m_parameterWatching = true;
+
+	// The first full sweep sees every parameter as new and sends them all
+	scanParameters(-1);
+}
+
+void VstInstance::stopParameterWatch()
+{
+	m_parameterWatching = false;
+}
+
+void VstInstance::onParameterAutomated(const int index, const float value)
+{
+	if (!m_parameterWatching || index < 0)
+		return;
+
+	std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+	if (size_t(index) >= m_parameterValues.size() || m_parameterValues[index] == value)
+		return;
+
+	m_parameterValues[index] = value;
+
+	if (!m_parameterDirty[index]) {
+		m_parameterDirty[index] = 1;
+		m_parameterDirtyList.push_back(index);
+	}
+
+	if (m_parametersPendingFunction)
+		m_parametersPendingFunction();
+}
+
+void VstInstance::scanParameters(const int count)
+{
+	if (!m_parameterWatching || m_effect == nullptr)
+		return;
+
+	const int numParams = m_effect->numParams > 0 ? m_effect->numParams : 0;
+	const int total = count < 0 || count > numParams ? numParams : count;
+
+	float values[ParameterScanSlice];
+	int done = 0;
+
+	while (done < total) {
+		int start;
+		int length;
+
+		{
+			std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+			if (m_parameterValues.size() != size_t(numParams)) {
+				m_parameterValues.assign(numParams, 0.0f);
+				m_parameterDirty.assign(numParams, 0);
+				m_parameterDirtyList.clear();
+				m_parameterScanCursor = 0;
+				m_parameterResized = true;
+			}
+
+			start = m_parameterScanCursor % (numParams > 0 ? numParams : 1);
+			length = std::min({ParameterScanSlice, total - done, numParams - start});
+			m_parameterScanCursor = (start + length) % (numParams > 0 ? numParams : 1);
+		}
+
+		// Read outside the lock, plug-ins may call back into audioMasterAutomate from getParameter
+		for (int i = 0; i < length; i++)
+			values[i] = m_effect->getParameter(m_effect, start + i);
+
+		bool changed = false;
+
+		{
+			std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+			if (m_parameterValues.size() != size_t(numParams))
+				return;
+
+			for (int i = 0; i < length; i++) {
+				const int index = start + i;
+
+				if (m_parameterValues[index] == values[i] && !m_parameterResized)
+					continue;
+
+				m_parameterValues[index] = values[i];
+				changed = true;
+
+				if (!m_parameterDirty[index]) {
+					m_parameterDirty[index] = 1;
+					m_parameterDirtyList.push_back(index);
+				}
+			}
+
+			if (start + length >= numParams)
+				m_parameterResized = false;
+		}
+
+		if (changed && m_parametersPendingFunction)
+			m_parametersPendingFunction();
+
+		done += length;
+	}
+}
+
+bool VstInstance::takeParameterChanges(grpc_parameterChanges &changes)
+{
+	std::lock_guard<std::mutex> grd(m_parameterMutex);
+
+	if (m_parameterDirtyList.empty())
+		return false;
+
+	changes.set_numparams(int32_t(m_parameterValues.size()));
+
+	for (int index : m_parameterDirtyList) {
+		changes.add_indices(index);
+		changes.add_values(m_parameterValues[index]);
+		m_parameterDirty[index] = 0;
+	}
+
+	m_parameterDirtyList.clear();
+	return true;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+#include "obs_vst_api.pb.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class AEffect;
+
+namespace SharedAudio {
+class Ring;
+}
+
+namespace SocketAudio {
+class Socket;
+}
+
+// Planes handed to the plug-in, allocated when the block size is negotiated and reused for every block
+class AudioBufferPool {
+public:
+	// Only ever grows, so steady state processing never allocates
+	void reserve(const int frames, const int numInputs, const int numOutputs);
+
+	float **inputs() { return m_inputs.data(); }
+	float **outputs() { return m_outputs.data(); }
+	int frames() const { return m_frames; }
+
+	std::mutex &mutex() { return m_mutex; }
+
+private:
+	int m_frames{0};
+	std::vector<float> m_storage;
+	std::vector<float *> m_inputs;
+	std::vector<float *> m_outputs;
+	std::mutex m_mutex;
+};
+
+// One loaded plug-in, with its own audio transports, parameter watch and AEffect generation
+class VstInstance {
+public:
+	VstInstance(const uint32_t id, const std::wstring &modulePath);
+	~VstInstance();
+
+public:
+	bool load();
+
+	// Stops the audio threads and parameter watch, the effect itself is closed by the host's effClose
+	void close();
+
+	// Processes on the calling thread, the server posts gRPC blocks to the audio thread and replies from there. False once closed
+	bool processBlock(const grpc_processReplacing_Request *request, grpc_processReplacing_Reply *reply);
+
+	// Instances run on this one's output for every block it processes, so a whole filter chain costs one transfer. Every block
+	// waits for each stage, so false and no chain when a stage already runs this instance, directly or further down its chain
+	bool setChain(std::vector<std::shared_ptr<VstInstance>> stages);
+
+	// Sizes the planes for blocks of up to frames once the block size is negotiated, chains included
+	void reserveBuffers(const int frames);
+
+	bool startSharedAudio(const std::string &name);
+	void stopSharedAudio();
+
+	bool startSocketAudio(const std::string &path);
+	void stopSocketAudio();
+
+	// Parameter changes pushed to the host, found through audioMasterAutomate and scans between blocks
+	void startParameterWatch();
+	void stopParameterWatch();
+	void onParameterAutomated(const int index, const float value);
+	void scanParameters(const int count);
+
+	// Moves the values changed since the last call into changes, false when there are none
+	bool takeParameterChanges(grpc_parameterChanges &changes);
+
+	// Called whenever a parameter change is pending, often from the audio thread, so it may only wake whoever sends them
+	std::function<void()> m_parametersPendingFunction;
+
+	// Bumps the generation whenever the plug-in's AEffect fields differ from the last snapshot
+	uint32_t refreshGeneration();
+
+	template<typename Reply> void setAEffect(const uint32_t knownGeneration, Reply *reply)
+	{
+		std::lock_guard<std::mutex> grd(m_generationMutex);
+		refreshGenerationLocked();
+
+		// The host already has this snapshot, only tell it which one is current
+		reply->set_generation(m_generation);
+
+		if (knownGeneration != m_generation)
+			*reply->mutable_aeffect() = m_snapshot;
+	}
+
+	// Parameters compared per block, a full sweep spreads over numParams / ParameterScanSlice blocks
+	static const int ParameterScanSlice = 64;
+
+	// Widest plug-in a chain stage may be, wider ones are left out of the chain
+	static const int MaxChainChannels = 32;
+
+public:
+	const uint32_t m_id;
+	AEffect *m_effect{nullptr};
+	AudioBufferPool m_bufferPool;
+	std::atomic<bool> m_closed{false};
+
+private:
+	void sharedAudioLoop();
+	void socketAudioLoop();
+	void refreshGenerationLocked();
+	void runChain(float **outputs, const int outputCount, const int numOutputs, const int frames);
+	bool chainReaches(const VstInstance *instance);
+
+private:
+	std::wstring m_modulePath;
+
+	// m_bufferPool's mutex is taken around each block by whichever transport runs it, transports move planes through their own
+	// buffers. A chain waits for each stage's pool in turn while holding its own, chains never form a cycle so this can't deadlock
+#ifdef WIN32
+	HMODULE m_dllHandle{NULL};
+#else
+	void *m_dllHandle{nullptr};
+#endif
+
+	std::mutex m_generationMutex;
+	grpc_AEffect m_snapshot;
+	uint32_t m_generation{0};
+
+	// Only touched with m_bufferPool's mutex held, sized whenever the chain or block size is set
+	AudioBufferPool m_chainPool;
+	std::mutex m_chainMutex;
+	std::shared_ptr<const std::vector<std::shared_ptr<VstInstance>>> m_chain;
+
+	std::unique_ptr<SharedAudio::Ring> m_sharedAudio;
+	std::thread m_sharedAudioThread;
+	std::atomic<bool> m_sharedAudioStop{false};
+	std::vector<float *> m_sharedInputs;
+	std::vector<float *> m_sharedOutputs;
+
+	// The loop blocks in accept and receive, stopSocketAudio wakes it through the listener or by shutting down the connection
+	std::unique_ptr<SocketAudio::Socket> m_socketListener;
+	std::thread m_socketAudioThread;
+	std::atomic<bool> m_socketAudioStop{false};
+	std::mutex m_socketAudioMutex;
+	SocketAudio::Socket *m_socketConnection{nullptr};
+
+	std::atomic<bool> m_parameterWatching{false};
+	std::mutex m_parameterMutex;
+	std::vector<float> m_parameterValues;
+	std::vector<char> m_parameterDirty;
+	std::vector<int> m_parameterDirtyList;
+	int m_parameterScanCursor{0};
+	bool m_parameterResized{false};
+};
@@ -1,39 +1,336 @@
 #include "VstModule.h"
+#include "ProxyLog.h"
 
-#include "..\vst_header\aeffectx.h"
-#include "..\headers\StlBuffer.h"
+#include "../vst_header/aeffectx.h"
 
 #include "obs_vst_api.grpc.pb.h"
 
+#include <algorithm>
 #include <filesystem>
 
+using grpc::CallbackServerContext;
 using grpc::Server;
+using grpc::ServerBidiReactor;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
+using grpc::ServerUnaryReactor;
+using grpc::ServerWriteReactor;
 using grpc::Status;
 
-class grpc_vst_communicatorImpl final : public grpc_vst_communicator::Service {
-	Status com_grpc_dispatcher(ServerContext *, const grpc_dispatcher_Request *request, grpc_dispatcher_Reply *reply) override
+// A unary block, processed and answered on the audio thread so the gRPC thread that took it goes straight back to polling
+struct BlockCall {
+	std::shared_ptr<VstInstance> instance;
+	const grpc_processReplacing_Request *request;
+	grpc_processReplacing_Reply *reply;
+	ServerUnaryReactor *reactor;
+
+	static void run(void *context)
+	{
+		std::unique_ptr<BlockCall> call(static_cast<BlockCall *>(context));
+
+		if (call->instance->processBlock(call->request, call->reply))
+			call->reactor->Finish(Status::OK);
+		else
+			call->reactor->Finish(Status(grpc::StatusCode::CANCELLED, "instance closed"));
+	}
+};
+
+// One stream carries every block of the filter until the host ends it, with one block in flight at a time
+class BlockStream final : public ServerBidiReactor<grpc_processReplacing_Request, grpc_processReplacing_Reply> {
+public:
+	BlockStream(std::shared_ptr<VstInstance> instance, AudioThread &audioThread) : m_instance(std::move(instance)), m_audioThread(audioThread)
+	{
+		StartRead(&m_request);
+	}
+
+	void OnReadDone(bool ok) override
+	{
+		// The host ended the stream
+		if (!ok) {
+			Finish(Status::OK);
+			return;
+		}
+
+		m_audioThread.post(&BlockStream::process, this);
+	}
+
+	void OnWriteDone(bool ok) override
+	{
+		if (!ok) {
+			Finish(Status::OK);
+			return;
+		}
+
+		StartRead(&m_request);
+	}
+
+	void OnDone() override { delete this; }
+
+private:
+	static void process(void *context)
+	{
+		BlockStream *stream = static_cast<BlockStream *>(context);
+		stream->m_reply.Clear();
+
+		if (stream->m_instance == nullptr || !stream->m_instance->processBlock(&stream->m_request, &stream->m_reply)) {
+			stream->Finish(Status(grpc::StatusCode::CANCELLED, "instance closed"));
+			return;
+		}
+
+		stream->StartWrite(&stream->m_reply);
+	}
+
+	std::shared_ptr<VstInstance> m_instance;
+	AudioThread &m_audioThread;
+	grpc_processReplacing_Request m_request;
+	grpc_processReplacing_Reply m_reply;
+};
+
+// Parameter changes pushed to the host. Only the module's watch thread starts writes and finishes it, reactions just wake that thread
+class ParameterWatch final : public ServerWriteReactor<grpc_parameterChanges> {
+public:
+	ParameterWatch(std::shared_ptr<VstInstance> instance, VstModule *owner) : m_instance(std::move(instance)), m_owner(owner) {}
+
+	void OnWriteDone(bool ok) override
+	{
+		if (!ok)
+			m_failed = true;
+
+		m_writing = false;
+		m_owner->wakeParameterWatches();
+	}
+
+	void OnCancel() override
+	{
+		m_cancelled = true;
+		m_owner->wakeParameterWatches();
+	}
+
+	void OnDone() override { delete this; }
+
+	// Sends what changed unless a write is still out, false once finished. gRPC may delete the watch any time after that
+	bool pump(const bool stopping)
+	{
+		if (m_writing)
+			return true;
+
+		if (m_failed || m_cancelled || stopping || m_instance->m_closed) {
+			m_instance->stopParameterWatch();
+			Finish(Status::OK);
+			return false;
+		}
+
+		m_changes.Clear();
+
+		if (!m_instance->takeParameterChanges(m_changes))
+			return true;
+
+		m_writing = true;
+		StartWrite(&m_changes);
+		return true;
+	}
+
+private:
+	std::shared_ptr<VstInstance> m_instance;
+	VstModule *m_owner;
+	grpc_parameterChanges m_changes;
+	std::atomic<bool> m_writing{false};
+	std::atomic<bool> m_failed{false};
+	std::atomic<bool> m_cancelled{false};
+};
+
+// Answers a watch for an instance this proxy doesn't have
+class MissingWatch final : public ServerWriteReactor<grpc_parameterChanges> {
+public:
+	MissingWatch() { Finish(Status(grpc::StatusCode::NOT_FOUND, "no such instance")); }
+
+	void OnDone() override { delete this; }
+};
+
+// Blocks go to the audio thread and control calls to the module's control thread, the gRPC threads only hand them on. Calls that
+// only read state the proxy keeps are answered right away
+class grpc_vst_communicatorImpl final : public grpc_vst_communicator::CallbackService {
+	ServerUnaryReactor *com_grpc_dispatcher(CallbackServerContext *context, const grpc_dispatcher_Request *request, grpc_dispatcher_Reply *reply) override
 	{
-		if (m_effect == nullptr)
-			return Status::OK;
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [this, instance, request, reply]() { dispatch(instance, request, reply); });
+	}
 
+	ServerUnaryReactor *com_grpc_processReplacing(CallbackServerContext *context, const grpc_processReplacing_Request *request,
+						      grpc_processReplacing_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		ServerUnaryReactor *reactor = context->DefaultReactor();
+		m_owner->audioThread().post(&BlockCall::run, new BlockCall{std::move(instance), request, reply, reactor});
+		return reactor;
+	}
+
+	ServerBidiReactor<grpc_processReplacing_Request, grpc_processReplacing_Reply> *com_grpc_processStream(CallbackServerContext *context) override
+	{
+		return new BlockStream(instanceFor(context), m_owner->audioThread());
+	}
+
+	ServerUnaryReactor *com_grpc_setParameter(CallbackServerContext *context, const grpc_setParameter_Request *request,
+						  grpc_setParameter_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [instance, request, reply]() {
+			instance->m_effect->setParameter(instance->m_effect, request->param1(), request->param2());
+			instance->setAEffect(request->generation(), reply);
+		});
+	}
+
+	ServerUnaryReactor *com_grpc_getParameter(CallbackServerContext *context, const grpc_getParameter_Request *request,
+						  grpc_getParameter_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [instance, request, reply]() {
+			reply->set_returnval(instance->m_effect->getParameter(instance->m_effect, request->param1()));
+			instance->setAEffect(request->generation(), reply);
+		});
+	}
+
+	ServerUnaryReactor *com_grpc_sendHwndMsg(CallbackServerContext *context, const grpc_sendHwndMsg_Request *request, grpc_sendHwndMsg_Reply *) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		m_owner->m_hwndSendFunction(instance->m_id, request->msgtype());
+		return finish(context);
+	}
+
+	ServerUnaryReactor *com_grpc_updateAEffect(CallbackServerContext *context, const grpc_updateAEffect_Request *request,
+						   grpc_updateAEffect_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		instance->setAEffect(request->generation(), reply);
+
+		return finish(context);
+	}
+
+	ServerUnaryReactor *com_grpc_stopServer(CallbackServerContext *context, const grpc_stopServer_Request *, grpc_stopServer_Reply *reply) override
+	{
+		m_owner->stop();
+		reply->set_nullreply(0);
+		return finish(context);
+	}
+
+	ServerWriteReactor<grpc_parameterChanges> *com_grpc_watchParameters(CallbackServerContext *context, const grpc_watchParameters_Request *) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return new MissingWatch();
+
+		instance->startParameterWatch();
+
+		auto *watch = new ParameterWatch(instance, m_owner);
+		m_owner->addParameterWatch(watch);
+		return watch;
+	}
+
+	ServerUnaryReactor *com_grpc_attachSharedAudio(CallbackServerContext *context, const grpc_attachSharedAudio_Request *request,
+						       grpc_attachSharedAudio_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [instance, request, reply]() { reply->set_attached(instance->startSharedAudio(request->name())); });
+	}
+
+	ServerUnaryReactor *com_grpc_attachSocketAudio(CallbackServerContext *context, const grpc_attachSocketAudio_Request *request,
+						       grpc_attachSocketAudio_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [instance, request, reply]() { reply->set_attached(instance->startSocketAudio(request->path())); });
+	}
+
+	ServerUnaryReactor *com_grpc_createInstance(CallbackServerContext *context, const grpc_createInstance_Request *request,
+						    grpc_createInstance_Reply *reply) override
+	{
+		return control(context, [this, request, reply]() {
+			// Paths travel as UTF-8
+			const std::wstring modulePath = std::filesystem::u8path(request->modulepath()).wstring();
+			std::shared_ptr<VstInstance> instance = m_owner->createInstance(modulePath);
+
+			reply->set_created(instance != nullptr);
+			reply->set_instance(instance != nullptr ? instance->m_id : 0);
+		});
+	}
+
+	ServerUnaryReactor *com_grpc_setChain(CallbackServerContext *context, const grpc_setChain_Request *request, grpc_setChain_Reply *reply) override
+	{
+		std::shared_ptr<VstInstance> instance = instanceFor(context);
+
+		if (instance == nullptr)
+			return finish(context);
+
+		return control(context, [this, instance, request, reply]() { chain(instance, request, reply); });
+	}
+
+private:
+	// Runs work on the module's control thread, which finishes the call once it returns
+	template<typename Work> ServerUnaryReactor *control(CallbackServerContext *context, Work work)
+	{
+		ServerUnaryReactor *reactor = context->DefaultReactor();
+
+		m_owner->postControl([reactor, work]() {
+			work();
+			reactor->Finish(Status::OK);
+		});
+
+		return reactor;
+	}
+
+	void dispatch(const std::shared_ptr<VstInstance> &instance, const grpc_dispatcher_Request *request, grpc_dispatcher_Reply *reply)
+	{
+		AEffect *effect = instance->m_effect;
 		int64_t retValue = 0;
 		std::string outputBuffer;
 
+		// The audio threads must not touch the effect while it closes
+		if (request->param1() == effClose)
+			instance->close();
+
 		switch (request->param1()) {
 		case effGetEffectName:
 		case effGetVendorString: {
 			// Needs a filled and ready buffer to write to
 			outputBuffer.resize(request->ptr_size());
-			retValue =
-				m_effect->dispatcher(m_effect, request->param1(), request->param2(), request->param3(), outputBuffer.data(), request->param4());
+			retValue = effect->dispatcher(effect, request->param1(), request->param2(), request->param3(), outputBuffer.data(), request->param4());
 			break;
 		}
 		case effGetChunk: {
 			// Needs an empty pointer
 			void *buf = nullptr;
-			intptr_t chunkSize = m_effect->dispatcher(m_effect, request->param1(), request->param2(), request->param3(), &buf, request->param4());
+			intptr_t chunkSize = effect->dispatcher(effect, request->param1(), request->param2(), request->param3(), &buf, request->param4());
 
 			outputBuffer.resize(chunkSize);
 			memcpy(outputBuffer.data(), buf, chunkSize);
@@ -43,13 +340,13 @@ class grpc_vst_communicatorImpl final : public grpc_vst_communicator::Service {
 		}
 		case effSetChunk: {
 			// Accepts the incoming data
-			retValue = m_effect->dispatcher(m_effect, request->param1(), request->param2(), request->param3(), (void *)request->ptr_data().data(),
-							request->param4());
+			retValue = effect->dispatcher(effect, request->param1(), request->param2(), request->param3(), (void *)request->ptr_data().data(),
+						      request->param4());
 			break;
 		}
 		default: {
-			retValue = m_effect->dispatcher(m_effect, request->param1(), request->param2(), request->param3(), (void *)request->ptr_value(),
-							request->param4());
+			retValue = effect->dispatcher(effect, request->param1(), request->param2(), request->param3(), (void *)request->ptr_value(),
+						      request->param4());
 			break;
 		}
 		}
@@ -57,256 +354,351 @@ class grpc_vst_communicatorImpl final : public grpc_vst_communicator::Service {
 		reply->set_returnval(retValue);
 		reply->set_ptr_data(outputBuffer);
 
+		// Buffers follow the negotiated block size, processing then only reuses them. The audio thread may be in a block meanwhile
+		if (request->param1() == effSetBlockSize)
+			instance->reserveBuffers(int(request->param3()));
+
+		// These can change every parameter at once, don't wait for the per-block sweep
+		switch (request->param1()) {
+		case effSetChunk:
+		case effSetProgram:
+		case effEndSetProgram:
+			instance->scanParameters(-1);
+			break;
+		}
+
 		if (request->param1() == effClose) {
-			m_effect = nullptr;
-			m_owner->m_stopSignal = true;
-			return Status::OK;
+			m_owner->closeInstance(instance->m_id);
+			return;
 		}
 
-		// afx data
-		reply->set_magic(m_effect->magic);
-		reply->set_numprograms(m_effect->numPrograms);
-		reply->set_numparams(m_effect->numParams);
-		reply->set_numinputs(m_effect->numInputs);
-		reply->set_numoutputs(m_effect->numOutputs);
-		reply->set_flags(m_effect->flags);
-		reply->set_initialdelay(m_effect->initialDelay);
-		reply->set_uniqueid(m_effect->uniqueID);
-		reply->set_version(m_effect->version);
+		instance->setAEffect(request->generation(), reply);
+	}
+
+	void chain(const std::shared_ptr<VstInstance> &instance, const grpc_setChain_Request *request, grpc_setChain_Reply *reply)
+	{
+		std::vector<std::shared_ptr<VstInstance>> stages;
+
+		for (const uint32_t id : request->stages()) {
+			std::shared_ptr<VstInstance> stage = m_owner->findInstance(id);
+
+			// Every stage has to live in this process and run once per block
+			if (stage == nullptr || stage == instance || std::find(stages.begin(), stages.end(), stage) != stages.end()) {
+				instance->setChain({});
+				reply->set_chained(false);
+				return;
+			}
 
-		return Status::OK;
+			stages.push_back(stage);
+		}
+
+		reply->set_chained(instance->setChain(std::move(stages)));
 	}
 
-	Status com_grpc_processReplacing(ServerContext *, const grpc_processReplacing_Request *request, grpc_processReplacing_Reply *reply) override
+	static ServerUnaryReactor *finish(CallbackServerContext *context)
 	{
-		if (m_effect == nullptr)
-			return Status::OK;
+		ServerUnaryReactor *reactor = context->DefaultReactor();
+		reactor->Finish(Status::OK);
+		return reactor;
+	}
 
-		size_t read_idx_a = 0;
-		size_t read_idx_b = 0;
+	std::shared_ptr<VstInstance> instanceFor(CallbackServerContext *context)
+	{
+		uint32_t id = 0;
 
-		float **adata = new float *[request->arraysize()];
-		float **bdata = new float *[request->arraysize()];
+		const auto &metadata = context->client_metadata();
+		auto it = metadata.find(VstModule::InstanceMetadataKey);
 
-		for (size_t c = 0; c < request->arraysize(); c++) {
-			adata[c] = new float[request->frames()];
-			bdata[c] = new float[request->frames()];
+		if (it != metadata.end())
+			id = uint32_t(strtoul(std::string(it->second.data(), it->second.size()).c_str(), nullptr, 10));
 
-			StlBuffer::pop_buffer(request->adata(), read_idx_a, (char *)adata[c], request->frames() * sizeof(float));
-			StlBuffer::pop_buffer(request->bdata(), read_idx_b, (char *)bdata[c], request->frames() * sizeof(float));
-		}
+		return m_owner->findInstance(id);
+	}
 
-		m_effect->processReplacing(m_effect, adata, bdata, request->frames());
+public:
+	VstModule *m_owner{nullptr};
+};
 
-		std::string buffer_adata;
-		std::string buffer_bdata;
+// Every method is a callback, only the reflection plugin's service is synchronous. Left alone it would grow a thread pool of its own
+static void limitSyncThreads(ServerBuilder &builder)
+{
+	builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS, 1);
+	builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MIN_POLLERS, 1);
+	builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MAX_POLLERS, 1);
+}
 
-		for (int c = 0; c < request->arraysize(); c++) {
-			buffer_adata.append((char *)adata[c], request->frames() * sizeof(float));
-			buffer_bdata.append((char *)bdata[c], request->frames() * sizeof(float));
+VstModule::VstModule(const std::wstring &modulePath, const int32_t listenPort, const int32_t audioPort)
+	: m_modulePath(modulePath),
+	  m_listenPort(listenPort),
+	  m_audioPort(audioPort)
+{
+}
 
-			delete[] adata[c];
-			delete[] bdata[c];
-		}
+VstModule::~VstModule()
+{
+	stopControl();
+	stopParameterWatches();
+
+	std::lock_guard<std::mutex> grd(m_instancesMutex);
+	m_instances.clear();
+}
+
+bool VstModule::start()
+{
+	// Vst
+	//
 
-		delete[] adata;
-		delete[] bdata;
+	m_audioThread.start();
+	m_controlThread = std::thread(&VstModule::controlLoop, this);
+	m_parameterWatchThread = std::thread(&VstModule::parameterWatchLoop, this);
 
-		reply->set_adata(buffer_adata);
-		reply->set_bdata(buffer_bdata);
+	// A spare proxy starts empty, the host loads its first plug-in with createInstance once it needs one
+	if (!m_modulePath.empty() && createInstance(m_modulePath) == nullptr)
+		return false;
 
-		// afx data
-		reply->set_magic(m_effect->magic);
-		reply->set_numprograms(m_effect->numPrograms);
-		reply->set_numparams(m_effect->numParams);
-		reply->set_numinputs(m_effect->numInputs);
-		reply->set_numoutputs(m_effect->numOutputs);
-		reply->set_flags(m_effect->flags);
-		reply->set_initialdelay(m_effect->initialDelay);
-		reply->set_uniqueid(m_effect->uniqueID);
-		reply->set_version(m_effect->version);
+	// Grpc
+	//
 
-		return Status::OK;
-	}
+	grpc::EnableDefaultHealthCheckService(true);
+	grpc::reflection::InitProtoReflectionServerBuilderPlugin();
 
-	Status com_grpc_setParameter(ServerContext *, const grpc_setParameter_Request *request, grpc_setParameter_Reply *reply) override
-	{
-		if (m_effect == nullptr)
-			return Status::OK;
+	// Port 0 binds any free one, the bound port replaces it once the server is up
+	const int32_t listenPort = m_listenPort;
 
-		m_effect->setParameter(m_effect, request->param1(), request->param2());
+	m_builder = std::make_unique<ServerBuilder>();
+	m_builder->AddListeningPort(std::string("localhost:") + std::to_string(listenPort), grpc::InsecureServerCredentials(), &m_listenPort);
+	limitSyncThreads(*m_builder);
+
+	m_service = std::make_unique<grpc_vst_communicatorImpl>();
+	m_service->m_owner = this;
+	m_builder->RegisterService(m_service.get());
 
-		// afx data
-		reply->set_magic(m_effect->magic);
-		reply->set_numprograms(m_effect->numPrograms);
-		reply->set_numparams(m_effect->numParams);
-		reply->set_numinputs(m_effect->numInputs);
-		reply->set_numoutputs(m_effect->numOutputs);
-		reply->set_flags(m_effect->flags);
-		reply->set_initialdelay(m_effect->initialDelay);
-		reply->set_uniqueid(m_effect->uniqueID);
-		reply->set_version(m_effect->version);
+	m_server = m_builder->BuildAndStart();
 
-		return Status::OK;
+	if (m_server == nullptr) {
+		proxyLog("no server on port %d", listenPort);
+		return false;
 	}
 
-	Status com_grpc_getParameter(ServerContext *, const grpc_getParameter_Request *request, grpc_getParameter_Reply *reply) override
-	{
-		if (m_effect == nullptr)
-			return Status::OK;
+	const int32_t audioPort = m_audioPort;
 
-		float result = m_effect->getParameter(m_effect, request->param1());
-		reply->set_returnval(result);
+	m_audioBuilder = std::make_unique<ServerBuilder>();
+	m_audioBuilder->AddListeningPort(std::string("localhost:") + std::to_string(audioPort), grpc::InsecureServerCredentials(), &m_audioPort);
+	limitSyncThreads(*m_audioBuilder);
 
-		// afx data
-		reply->set_magic(m_effect->magic);
-		reply->set_numprograms(m_effect->numPrograms);
-		reply->set_numparams(m_effect->numParams);
-		reply->set_numinputs(m_effect->numInputs);
-		reply->set_numoutputs(m_effect->numOutputs);
-		reply->set_flags(m_effect->flags);
-		reply->set_initialdelay(m_effect->initialDelay);
-		reply->set_uniqueid(m_effect->uniqueID);
-		reply->set_version(m_effect->version);
+	m_audioService = std::make_unique<grpc_vst_communicatorImpl>();
+	m_audioService->m_owner = this;
+	m_audioBuilder->RegisterService(m_audioService.get());
 
-		return Status::OK;
+	m_audioServer = m_audioBuilder->BuildAndStart();
+
+	// Reported as 0, the host sends blocks to the control server instead
+	if (m_audioServer == nullptr) {
+		proxyLog("no audio server on port %d", audioPort);
+		m_audioPort = 0;
 	}
 
-	Status com_grpc_sendHwndMsg(ServerContext *, const grpc_sendHwndMsg_Request *request, grpc_sendHwndMsg_Reply *) override
-	{
-		if (m_effect == nullptr)
-			return Status::OK;
+	return true;
+}
 
-		m_owner->m_hwndSendFunction(request->msgtype());
-		return Status::OK;
-	}
+void VstModule::join()
+{
+	if (m_server == nullptr)
+		return;
 
-	Status com_grpc_updateAEffect(ServerContext *, const grpc_updateAEffect_Request *, grpc_updateAEffect_Reply *reply) override
-	{
-		if (m_effect == nullptr)
-			return Status::OK;
+	m_server->Wait();
 
-		// afx data
-		reply->set_magic(m_effect->magic);
-		reply->set_numprograms(m_effect->numPrograms);
-		reply->set_numparams(m_effect->numParams);
-		reply->set_numinputs(m_effect->numInputs);
-		reply->set_numoutputs(m_effect->numOutputs);
-		reply->set_flags(m_effect->flags);
-		reply->set_initialdelay(m_effect->initialDelay);
-		reply->set_uniqueid(m_effect->uniqueID);
-		reply->set_version(m_effect->version);
+	if (m_audioServer != nullptr)
+		m_audioServer->Wait();
 
-		return Status::OK;
-	}
+	m_stopSignal = true;
+	stopControl();
+
+	// Cleanup
+	std::lock_guard<std::mutex> grd(m_instancesMutex);
+
+	for (auto &entry : m_instances)
+		entry.second->close();
+
+	m_instances.clear();
+	m_audioThread.stop();
+
+	// Every watch was finished for the servers to shut down
+	stopParameterWatches();
+}
+
+void VstModule::shutdown_server()
+{
+	// Watches finish here rather than holding up the shutdown
+	wakeParameterWatches();
+
+	if (m_server == nullptr)
+		return;
+
+	// Bounded so an audio stream the host never closed can't hold the proxy open
+	const auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(1);
+
+	if (m_audioServer != nullptr)
+		m_audioServer->Shutdown(deadline);
+
+	m_server->Shutdown(deadline);
+}
+
+std::shared_ptr<VstInstance> VstModule::createInstance(const std::wstring &modulePath)
+{
+	uint32_t id;
 
-	Status com_grpc_stopServer(ServerContext *, const grpc_stopServer_Request *, grpc_stopServer_Reply *reply) override
 	{
-		m_owner->m_stopSignal = true;
-		reply->set_nullreply(0);
-		return Status::OK;
+		std::lock_guard<std::mutex> grd(m_instancesMutex);
+		id = m_nextInstance++;
 	}
 
-public:
-	AEffect *m_effect{nullptr};
-	VstModule *m_owner{nullptr};
-};
+	auto instance = std::make_shared<VstInstance>(id, modulePath);
 
-VstModule::VstModule(const std::wstring &modulePath, const int32_t listenPort) : m_modulePath(modulePath), m_listenPort(listenPort) {}
+	if (!instance->load())
+		return nullptr;
 
-VstModule::~VstModule()
+	instance->m_parametersPendingFunction = [this]() { wakeParameterWatches(); };
+
+	std::lock_guard<std::mutex> grd(m_instancesMutex);
+	m_instances[id] = instance;
+	return instance;
+}
+
+std::shared_ptr<VstInstance> VstModule::findInstance(const uint32_t id)
 {
-	if (m_dllHandle != NULL)
-		::FreeLibrary(m_dllHandle);
+	std::lock_guard<std::mutex> grd(m_instancesMutex);
+	auto it = m_instances.find(id);
+	return it != m_instances.end() ? it->second : nullptr;
 }
 
-bool VstModule::start()
+void VstModule::closeInstance(const uint32_t id)
 {
-	// Vst
-	//
+	bool empty;
 
-	typedef AEffect *(*vstPluginMain)(audioMasterCallback audioMaster);
+	{
+		std::lock_guard<std::mutex> grd(m_instancesMutex);
+		m_instances.erase(id);
+		empty = m_instances.empty();
+	}
 
-	::SetDllDirectoryW(std::filesystem::path(m_modulePath).remove_filename().c_str());
-	m_dllHandle = ::LoadLibraryW(m_modulePath.c_str());
-	::SetDllDirectoryW(nullptr);
+	if (m_hwndSendFunction)
+		m_hwndSendFunction(id, InstanceClosedMsg);
 
-	if (m_dllHandle == NULL)
-		return false;
+	if (empty)
+		stop();
+}
 
-	vstPluginMain mainEntryPoint = (vstPluginMain)GetProcAddress(m_dllHandle, "VSTPluginMain");
+void VstModule::stop()
+{
+	m_stopSignal = true;
+	wakeParameterWatches();
 
-	if (mainEntryPoint == nullptr)
-		mainEntryPoint = (vstPluginMain)GetProcAddress(m_dllHandle, "VstPluginMain()");
+	if (m_hwndSendFunction)
+		m_hwndSendFunction(0, StoppedMsg);
+}
 
-	if (mainEntryPoint == nullptr)
-		mainEntryPoint = (vstPluginMain)GetProcAddress(m_dllHandle, "main");
+void VstModule::postControl(std::function<void()> work)
+{
+	{
+		std::lock_guard<std::mutex> grd(m_controlMutex);
+		m_controlWork.push_back(std::move(work));
+	}
 
-	if (mainEntryPoint == nullptr)
-		return false;
+	m_controlCondition.notify_one();
+}
 
-	// Instantiate the plug-in
-	m_effect = mainEntryPoint([](AEffect *effect, int32_t opcode, int32_t /*index*/, intptr_t /*value*/, void * /*ptr*/, float /*opt*/) {
-		// hostCallback
-		if (effect && effect->user != nullptr) {
-			intptr_t result = 0;
+void VstModule::controlLoop()
+{
+	for (;;) {
+		std::function<void()> work;
 
-			switch (opcode) {
-			case audioMasterSizeWindow:
-				return static_cast<intptr_t>(0);
-			}
+		{
+			std::unique_lock<std::mutex> lck(m_controlMutex);
+			m_controlCondition.wait(lck, [this]() { return !m_controlWork.empty() || m_controlStop; });
 
-			return result;
-		}
+			if (m_controlWork.empty())
+				break;
 
-		switch (opcode) {
-		case audioMasterVersion:
-			return static_cast<intptr_t>(2400);
-		default:
-			return static_cast<intptr_t>(0);
+			work = std::move(m_controlWork.front());
+			m_controlWork.pop_front();
 		}
-	});
 
-	if (m_effect == nullptr)
-		return false;
+		work();
+	}
+}
 
-	m_effect->user = reinterpret_cast<void *>(1);
+void VstModule::stopControl()
+{
+	if (!m_controlThread.joinable())
+		return;
 
-	// Grpc
-	//
+	{
+		std::lock_guard<std::mutex> grd(m_controlMutex);
+		m_controlStop = true;
+	}
 
-	grpc::EnableDefaultHealthCheckService(true);
-	grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+	m_controlCondition.notify_one();
+	m_controlThread.join();
+}
 
-	m_builder = std::make_unique<ServerBuilder>();
-	m_builder->AddListeningPort(std::string("localhost:") + std::to_string(m_listenPort), grpc::InsecureServerCredentials());
+void VstModule::addParameterWatch(ParameterWatch *watch)
+{
+	{
+		std::lock_guard<std::mutex> grd(m_parameterWatchMutex);
+		m_parameterWatches.push_back(watch);
+	}
 
-	m_service = std::make_unique<grpc_vst_communicatorImpl>();
-	m_service->m_effect = m_effect;
-	m_service->m_owner = this;
-	m_builder->RegisterService(m_service.get());
+	// The first sweep is already pending
+	wakeParameterWatches();
+}
 
-	m_server = m_builder->BuildAndStart();
-	return true;
+void VstModule::wakeParameterWatches()
+{
+	{
+		std::lock_guard<std::mutex> grd(m_parameterWakeMutex);
+		m_parameterWakeup = true;
+	}
+
+	m_parameterWakeCondition.notify_one();
 }
 
-void VstModule::join()
+void VstModule::parameterWatchLoop()
 {
-	if (m_server == nullptr)
-		return;
+	for (;;) {
+		bool stopping;
 
-	m_server->Wait();
-	m_stopSignal = true;
+		{
+			std::unique_lock<std::mutex> lck(m_parameterWakeMutex);
 
-	// Cleanup
-	FreeLibrary(m_dllHandle);
-	m_dllHandle = NULL;
+			// Changes, finished writes, closed instances and the module stopping all wake this, there's nothing to poll for
+			m_parameterWakeCondition.wait(lck, [this]() { return m_parameterWakeup || m_parameterWatchStop; });
+			m_parameterWakeup = false;
+			stopping = m_parameterWatchStop;
+		}
+
+		std::lock_guard<std::mutex> grd(m_parameterWatchMutex);
+		const bool finishing = stopping || m_stopSignal;
+
+		m_parameterWatches.erase(std::remove_if(m_parameterWatches.begin(), m_parameterWatches.end(),
+							[finishing](ParameterWatch *watch) { return !watch->pump(finishing); }),
+					 m_parameterWatches.end());
+
+		if (stopping && m_parameterWatches.empty())
+			break;
+	}
 }
 
-void VstModule::shutdown_server()
+void VstModule::stopParameterWatches()
 {
-	if (m_server == nullptr)
+	if (!m_parameterWatchThread.joinable())
 		return;
 
-	m_server->Shutdown();
+	{
+		std::lock_guard<std::mutex> grd(m_parameterWakeMutex);
+		m_parameterWatchStop = true;
+	}
+
+	m_parameterWakeCondition.notify_one();
+	m_parameterWatchThread.join();
 }
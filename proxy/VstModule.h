@@ -1,41 +1,115 @@
 #pragma once
 
-#include "VstWindow.h"
+#include "AudioThread.h"
+#include "VstInstance.h"
 
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <thread>
+#include <vector>
+
 using grpc::CallbackServerContext;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerUnaryReactor;
 using grpc::Status;
 
-class AEffect;
 class grpc_vst_communicatorImpl;
+class ParameterWatch;
 
 class VstModule {
 public:
-	VstModule(const std::wstring &modulePath, const int32_t listenPort);
+	// Audio blocks get a server of their own on audioPort. A port of 0 binds any free one
+	VstModule(const std::wstring &modulePath, const int32_t listenPort, const int32_t audioPort = 0);
 	~VstModule();
 
 public:
 	bool start();
 	void join();
+
+	// The ports bound once started, for the host to connect to. An audio port of 0 means blocks go to the control server
+	int32_t listenPort() const { return m_listenPort; }
+	int32_t audioPort() const { return m_audioPort; }
 	void shutdown_server();
 
+	// Instance 0 is loaded at start from the command line unless it is empty, the host adds more to share this process
+	std::shared_ptr<VstInstance> createInstance(const std::wstring &modulePath);
+	std::shared_ptr<VstInstance> findInstance(const uint32_t id);
+
+	// The process ends with its last instance
+	void closeInstance(const uint32_t id);
+
+	// Ends the main loop, which sleeps until a window message, a command or the host's exit rather than polling
+	void stop();
+
+	// Runs every block of every instance, gRPC blocks are posted to it and answered from it
+	AudioThread &audioThread() { return m_audioThread; }
+
+	// Control calls run here one at a time, off the gRPC threads that also serve blocks and watches. Work queued when the
+	// server stops still runs
+	void postControl(std::function<void()> work);
+
+	// Watches are served by one thread for the whole proxy, woken whenever an instance has changes pending
+	void addParameterWatch(ParameterWatch *watch);
+	void wakeParameterWatches();
+
+	// Calls name their instance in this metadata entry, calls without it go to instance 0
+	static constexpr const char *InstanceMetadataKey = "vst-instance";
+
 public:
-	AEffect *m_effect{nullptr};
 	std::atomic<bool> m_stopSignal{false};
-	std::function<void(int msgType)> m_hwndSendFunction;
+
+	// Window messages for the main thread, closed instances send InstanceClosedMsg so their window goes away, stop() sends StoppedMsg to wake it
+	std::function<void(uint32_t instance, int msgType)> m_hwndSendFunction;
+	static const int InstanceClosedMsg = -1;
+	static const int StoppedMsg = -2;
 
 private:
 	int32_t m_listenPort{0};
-	HMODULE m_dllHandle{NULL};
+	int32_t m_audioPort{0};
 
 	std::wstring m_modulePath;
 	std::unique_ptr<Server> m_server;
 	std::unique_ptr<ServerBuilder> m_builder;
 	std::unique_ptr<grpc_vst_communicatorImpl> m_service;
+
+	// Own listener and connection, a chunk transfer or an open editor on the control server never delays a block
+	std::unique_ptr<Server> m_audioServer;
+	std::unique_ptr<ServerBuilder> m_audioBuilder;
+	std::unique_ptr<grpc_vst_communicatorImpl> m_audioService;
+
+	// Shared by every instance, declared before them so it outlives them
+	AudioThread m_audioThread;
+
+	std::mutex m_instancesMutex;
+	std::map<uint32_t, std::shared_ptr<VstInstance>> m_instances;
+	uint32_t m_nextInstance{0};
+
+	void controlLoop();
+	void stopControl();
+
+	std::thread m_controlThread;
+	std::mutex m_controlMutex;
+	std::condition_variable m_controlCondition;
+	std::deque<std::function<void()>> m_controlWork;
+	bool m_controlStop{false};
+
+	void parameterWatchLoop();
+	void stopParameterWatches();
+
+	std::thread m_parameterWatchThread;
+	std::mutex m_parameterWatchMutex;
+	std::vector<ParameterWatch *> m_parameterWatches;
+
+	// Separate from m_parameterWatchMutex, watches wake the thread from reactions gRPC may run while a write is being started
+	std::mutex m_parameterWakeMutex;
+	std::condition_variable m_parameterWakeCondition;
+	bool m_parameterWakeup{false};
+	bool m_parameterWatchStop{false};
 };
@@ -98,14 +98,27 @@ void VstWindow::init()
 	m_hwnd = hwnd;
 }
 
+// Every instance's window lives on the main thread, one pump serves them all. Drains the queue, the main loop only wakes for new input
 void VstWindow::update()
 {
 	MSG msg;
 
-	if (!::PeekMessage(&msg, NULL, NULL, NULL, PM_REMOVE))
+	while (::PeekMessage(&msg, NULL, NULL, NULL, PM_REMOVE)) {
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+}
+
+// Called on the main thread, so the window is handled directly rather than through the thread's queue
+void VstWindow::sendMsg(const VstProxy::WM_USER_MSG msg)
+{
+	if (msg == VstProxy::WM_USER_MSG::WM_USER_CREATE_WINDOW)
+		init();
+
+	if (m_hwnd == NULL)
 		return;
 
-	switch (msg.message) {
+	switch (msg) {
 	case VstProxy::WM_USER_SHOW: {
 		::ShowWindow(m_hwnd, SW_SHOW);
 		::ShowWindow(m_hwnd, SW_HIDE);
@@ -127,16 +140,13 @@ void VstWindow::update()
 		break;
 	}
 	}
-
-	TranslateMessage(&msg);
-	DispatchMessage(&msg);
 }
 
-void VstWindow::sendMsg(const VstProxy::WM_USER_MSG msg)
+void VstWindow::destroy()
 {
-	if (msg == VstProxy::WM_USER_MSG::WM_USER_CREATE_WINDOW)
-		init();
-
+	// The effect is already closed, only the frame is left
 	if (m_hwnd != NULL)
-		::PostMessage(NULL, static_cast<UINT>(msg), NULL, NULL);
+		::DestroyWindow(m_hwnd);
+
+	m_hwnd = NULL;
 }
@@ -19,8 +19,10 @@ public:
 
 public:
 	void init();
-	void update();
 	void sendMsg(const VstProxy::WM_USER_MSG msg);
+	void destroy();
+
+	static void update();
 
 private:
 	AEffect *m_effect;
@@ -0,0 +1,89 @@
+// linux-streamlabs-vst.cpp : Headless proxy for Linux, same protocol as win-streamlabs-vst without plug-in editors.
+//
+
+#include "VstModule.h"
+
+#include <filesystem>
+#include <string>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+		return 0;
+
+	// Arguments match the Windows proxy: module path (empty for a spare), port, owner process id, then optionally the audio port and the
+	// descriptor to report the bound ports on. Ports of 0 bind any free one
+	const std::wstring modulePath = std::filesystem::u8path(argv[1]).wstring();
+	const int32_t port = atoi(argv[2]);
+	const pid_t ownerProcessId = pid_t(atoi(argv[3]));
+	const int32_t audioPort = argc > 4 ? atoi(argv[4]) : 0;
+	const int reportFd = argc > 5 ? atoi(argv[5]) : -1;
+
+	// Reparented once the host is gone, which ends the loop below. PR_SET_PDEATHSIG would follow the spawning thread, not the host
+	if (getppid() != ownerProcessId)
+		return 0;
+
+	// Audio sockets report a closed host as an error instead
+	signal(SIGPIPE, SIG_IGN);
+
+	VstModule mod(modulePath, port, audioPort);
+
+	// No editors without a window system, the only message to act on is the one waking the main loop to stop
+	const int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (wakeFd < 0)
+		return 0;
+
+	mod.m_hwndSendFunction = [wakeFd](uint32_t, int msgType) {
+		if (msgType != VstModule::StoppedMsg)
+			return;
+
+		const uint64_t one = 1;
+		(void)!write(wakeFd, &one, sizeof(one));
+	};
+
+	// Readable once the host exits. Kernels before 5.3 have no pidfd, the loop then checks on the owner once a second
+	int ownerFd = -1;
+#ifdef SYS_pidfd_open
+	ownerFd = int(syscall(SYS_pidfd_open, ownerProcessId, 0));
+#endif
+
+	if (!mod.start())
+		return 0;
+
+	// The host waits for this line before connecting, closing the descriptor tells it there is nothing more
+	if (reportFd >= 0) {
+		const std::string report = std::to_string(mod.listenPort()) + " " + std::to_string(mod.audioPort()) + "\n";
+		(void)!write(reportFd, report.data(), report.size());
+		close(reportFd);
+	}
+
+	// Sleeps until the host exits or the module stops, without a pidfd the owner is checked once a second
+	while (getppid() == ownerProcessId && !mod.m_stopSignal) {
+		pollfd fds[] = {{wakeFd, POLLIN, 0}, {ownerFd, POLLIN, 0}};
+
+		if (poll(fds, ownerFd >= 0 ? 2 : 1, ownerFd >= 0 ? -1 : 1000) < 0 && errno != EINTR)
+			break;
+
+		if (fds[1].revents != 0)
+			break;
+
+		uint64_t count;
+		(void)!read(wakeFd, &count, sizeof(count));
+	}
+
+	mod.m_stopSignal = true;
+	mod.shutdown_server();
+	mod.join();
+
+	if (ownerFd >= 0)
+		close(ownerFd);
+
+	close(wakeFd);
+	return 0;
+}
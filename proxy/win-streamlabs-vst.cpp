@@ -5,15 +5,16 @@
 
 #include "VstModule.h"
 #include "VstWindow.h"
+#include "CommandQueue.h"
 
 #ifndef _DEBUG
 #include "MakeMinidump.h"
 #endif
 
+#include <map>
 #include <shellapi.h>
-#include <timeapi.h>
-
-#pragma comment(lib, "Winmm.lib")
+#include <string>
+#include <thread>
 
 int WINAPI wWinMain(HINSTANCE /*hInstance*/, HINSTANCE /*hPrevInstance*/, PWSTR pCmdLine, int /*nCmdShow*/)
 {
@@ -28,52 +29,108 @@ int WINAPI wWinMain(HINSTANCE /*hInstance*/, HINSTANCE /*hPrevInstance*/, PWSTR
 	if (argc < 3)
 		return 0;
 
-	::timeBeginPeriod(1);
-
 	const std::wstring modulePath = argv[0];
 	const std::wstring pipid = argv[1];
 	const std::wstring ownerProcessId = argv[2];
+	const int32_t audioPort = argc > 3 ? _wtoi(argv[3]) : 0;
+
+	// Inherited from the host, which reads the bound ports from it. Ports of 0 bind any free one
+	const HANDLE report = argc > 4 ? HANDLE(uintptr_t(_wcstoui64(argv[4], nullptr, 10))) : NULL;
 
 	HANDLE obs64 = OpenProcess(SYNCHRONIZE, FALSE, _wtoi(ownerProcessId.c_str()));
 
 	if (obs64 == NULL)
 		return 0;
 
-	std::mutex mtx;
-	std::vector<int> outsideHwndMsgContainer;
+	// Window messages come from the gRPC threads, they take turns as the queue's one producer
+	std::mutex producerMutex;
+	CommandQueue<std::pair<uint32_t, int>, 256> commands;
+	HANDLE commandEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+	VstModule mod(modulePath, _wtoi(pipid.c_str()), audioPort);
+	mod.m_hwndSendFunction = [&](uint32_t instance, int msgType) {
+		{
+			std::lock_guard<std::mutex> grd(producerMutex);
+
+			// Only full while the main thread is busy in an editor, it catches up unless it is on its way out
+			while (!commands.push({instance, msgType}) && !mod.m_stopSignal)
+				std::this_thread::yield();
+		}
 
-	VstModule mod(modulePath, _wtoi(pipid.c_str()));
-	mod.m_hwndSendFunction = [&](int msgType) {
-		std::lock_guard<std::mutex> grd(mtx);
-		outsideHwndMsgContainer.push_back(msgType);
+		SetEvent(commandEvent);
 	};
 
 	if (!mod.start()) {
 		return 0;
 	}
 
-	VstWindow vstWindow(mod.m_effect);
+	// The host waits for this line before connecting, closing the handle tells it there is nothing more
+	if (report != NULL) {
+		const std::string ports = std::to_string(mod.listenPort()) + " " + std::to_string(mod.audioPort()) + "\n";
+		DWORD written = 0;
+		WriteFile(report, ports.data(), DWORD(ports.size()), &written, NULL);
+		CloseHandle(report);
+	}
 
-	while (WaitForSingleObject(obs64, 0) == WAIT_TIMEOUT && !mod.m_stopSignal) {
-		std::vector<int> insideMsgsCpy;
+	// One window per instance, each holds its instance so the plug-in isn't unloaded under an open editor
+	struct InstanceWindow {
+		std::shared_ptr<VstInstance> instance;
+		std::unique_ptr<VstWindow> window;
+	};
 
-		{
-			std::lock_guard<std::mutex> grd(mtx);
-			insideMsgsCpy.swap(outsideHwndMsgContainer);
-		}
+	std::map<uint32_t, InstanceWindow> vstWindows;
+
+	// Sleeps until the host exits, a command arrives or an editor window has input, this thread has no timeout of its own
+	const HANDLE waitHandles[] = {obs64, commandEvent};
+
+	while (!mod.m_stopSignal) {
+		const DWORD woken = MsgWaitForMultipleObjectsEx(2, waitHandles, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
 
-		vstWindow.update();
+		if (woken == WAIT_OBJECT_0 || woken == WAIT_FAILED)
+			break;
+
+		VstWindow::update();
 
 		// The module's window will run on the main thread
-		for (auto msg : insideMsgsCpy)
-			vstWindow.sendMsg(static_cast<VstProxy::WM_USER_MSG>(msg));
+		std::pair<uint32_t, int> msg;
+
+		while (commands.pop(msg)) {
+			if (msg.second == VstModule::StoppedMsg)
+				continue;
+
+			if (msg.second == VstModule::InstanceClosedMsg) {
+				auto closed = vstWindows.find(msg.first);
+
+				if (closed != vstWindows.end()) {
+					closed->second.window->destroy();
+					vstWindows.erase(closed);
+				}
+
+				continue;
+			}
+
+			auto it = vstWindows.find(msg.first);
 
-		Sleep(1);
+			if (it == vstWindows.end()) {
+				std::shared_ptr<VstInstance> instance = mod.findInstance(msg.first);
+
+				if (instance == nullptr)
+					continue;
+
+				it = vstWindows.emplace(msg.first, InstanceWindow{instance, std::make_unique<VstWindow>(instance->m_effect)}).first;
+			}
+
+			it->second.window->sendMsg(static_cast<VstProxy::WM_USER_MSG>(msg.second));
+		}
 	}
 
+	vstWindows.clear();
+
 	CloseHandle(obs64);
 	mod.m_stopSignal = true;
 	mod.shutdown_server();
 	mod.join();
+
+	CloseHandle(commandEvent);
 	return 0;
 }
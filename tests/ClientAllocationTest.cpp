@@ -0,0 +1,308 @@
+/*
+ * Checks the host's audio paths for allocations in steady state.
+ *
+ * A grpc_vst_communicatorClient talks to an in-process stand-in for the proxy,
+ * which echoes every block back. Over shared memory, processReplacing must not
+ * allocate at all after a few warm-up blocks. gRPC's own call bookkeeping
+ * allocates per call, so the unary and stream paths are held to what the client
+ * owns instead: its block messages' arena and payload buffers must neither grow
+ * nor move once blocks are flowing.
+ */
+#include "headers/grpc_vst_communicatorClient.h"
+
+#include <aeffectx.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+// Only the thread running the audio path counts, gRPC's own threads allocate whenever they like
+static thread_local bool t_counting = false;
+static thread_local size_t t_allocations = 0;
+
+void *operator new(size_t size)
+{
+	if (t_counting)
+		t_allocations++;
+
+	void *ptr = malloc(size > 0 ? size : 1);
+
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+static const uint32_t Frames = 1024;
+static const uint32_t Channels = 2;
+static const uint32_t Generation = 1;
+static const int WarmupBlocks = 16;
+static const int CountedBlocks = 1000;
+
+// The parts of the proxy the client talks to for shared memory audio, blocks come back unchanged
+class EchoProxy final : public grpc_vst_communicator::Service {
+public:
+	~EchoProxy() { stop(); }
+
+	void stop()
+	{
+		m_stop = true;
+
+		if (m_ring.isOpen())
+			m_ring.signal(SharedAudio::ToProxy);
+
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	grpc::Status com_grpc_updateAEffect(grpc::ServerContext *, const grpc_updateAEffect_Request *, grpc_updateAEffect_Reply *reply) override
+	{
+		grpc_AEffect *fields = reply->mutable_aeffect();
+		fields->set_magic(kEffectMagic);
+		fields->set_numinputs(Channels);
+		fields->set_numoutputs(Channels);
+		reply->set_generation(Generation);
+		return grpc::Status::OK;
+	}
+
+	grpc::Status com_grpc_processReplacing(grpc::ServerContext *, const grpc_processReplacing_Request *request,
+					       grpc_processReplacing_Reply *reply) override
+	{
+		echo(*request, *reply);
+		return grpc::Status::OK;
+	}
+
+	grpc::Status com_grpc_processStream(grpc::ServerContext *,
+					    grpc::ServerReaderWriter<grpc_processReplacing_Reply, grpc_processReplacing_Request> *stream) override
+	{
+		grpc_processReplacing_Request request;
+		grpc_processReplacing_Reply reply;
+
+		while (stream->Read(&request)) {
+			echo(request, reply);
+
+			if (!stream->Write(reply))
+				break;
+		}
+
+		return grpc::Status::OK;
+	}
+
+	grpc::Status com_grpc_attachSharedAudio(grpc::ServerContext *, const grpc_attachSharedAudio_Request *request,
+						grpc_attachSharedAudio_Reply *reply) override
+	{
+		reply->set_attached(m_ring.open(request->name()));
+
+		if (reply->attached())
+			m_thread = std::thread(&EchoProxy::loop, this);
+
+		return grpc::Status::OK;
+	}
+
+private:
+	static void echo(const grpc_processReplacing_Request &request, grpc_processReplacing_Reply &reply)
+	{
+		reply.set_frames(request.frames());
+		reply.set_arraysize(request.outputsize());
+		reply.set_bdata(request.adata());
+		reply.set_generation(Generation);
+	}
+
+	void loop()
+	{
+		while (!m_stop) {
+			while (SharedAudio::BlockHeader *block = m_ring.beginRead(SharedAudio::ToProxy)) {
+				SharedAudio::BlockHeader *result = m_ring.beginWrite(SharedAudio::ToHost);
+
+				if (result != nullptr) {
+					for (uint32_t c = 0; c < block->numOutputs; c++)
+						memcpy(m_ring.channel(result, c), m_ring.channel(block, c < block->numInputs ? c : 0), block->frames * sizeof(float));
+
+					result->sequence = block->sequence;
+					result->frames = block->frames;
+					result->numInputs = 0;
+					result->numOutputs = block->numOutputs;
+					result->flags = 0;
+					result->generation = Generation;
+				}
+
+				m_ring.endRead(SharedAudio::ToProxy);
+
+				if (result != nullptr)
+					m_ring.endWrite(SharedAudio::ToHost);
+			}
+
+			m_ring.wait(SharedAudio::ToProxy);
+		}
+	}
+
+	SharedAudio::Ring m_ring;
+	std::thread m_thread;
+	std::atomic<bool> m_stop{false};
+};
+
+static void fillInput(float (&input)[Channels][Frames])
+{
+	for (uint32_t c = 0; c < Channels; c++) {
+		for (uint32_t i = 0; i < Frames; i++)
+			input[c][i] = float(c + 1) * float(i) / Frames;
+	}
+}
+
+// Shared memory audio, nothing on the audio thread may allocate
+static int checkSharedAudio(const std::shared_ptr<grpc::Channel> &channel, EchoProxy &proxy)
+{
+	grpc_vst_communicatorClient client(channel, channel);
+	AEffect effect = {};
+	int failures = 0;
+
+#ifdef WIN32
+	const std::string name = "obs-vst-alloc-test-" + std::to_string(GetCurrentProcessId());
+#else
+	const std::string name = "obs-vst-alloc-test-" + std::to_string(getpid());
+#endif
+
+	client.updateAEffect(&effect);
+	client.reserveAudioBuffers(Frames, Channels);
+
+	if (!client.m_connected || !client.attachSharedAudio(&effect, name, Frames, Channels)) {
+		fprintf(stderr, "FAIL: shared memory audio didn't attach\n");
+		return 1;
+	}
+
+	float input[Channels][Frames];
+	float output[Channels][Frames];
+	float *inputs[Channels] = {input[0], input[1]};
+	float *outputs[Channels] = {output[0], output[1]};
+	fillInput(input);
+
+	t_allocations = 0;
+
+	for (int block = 0; block < WarmupBlocks + CountedBlocks; block++) {
+		t_counting = block >= WarmupBlocks;
+		const bool processed = client.processReplacing(&effect, inputs, Channels, outputs, Channels, Frames);
+		t_counting = false;
+
+		if (!processed || memcmp(input, output, sizeof(input)) != 0) {
+			fprintf(stderr, "FAIL: shared memory block %d wasn't echoed\n", block);
+			failures++;
+			break;
+		}
+	}
+
+	printf("shared memory: %zu allocations in %d steady state blocks\n", t_allocations, CountedBlocks);
+
+	if (t_allocations != 0) {
+		fprintf(stderr, "FAIL: the shared memory audio path allocates\n");
+		failures++;
+	}
+
+	proxy.stop();
+	client.closeInstance();
+	return failures;
+}
+
+// Unary calls or the stream, the client's block messages must be reused as they are
+static int checkGrpcAudio(const std::shared_ptr<grpc::Channel> &channel, const bool stream)
+{
+	const char *path = stream ? "gRPC stream" : "gRPC unary";
+	grpc_vst_communicatorClient client(channel, channel);
+	AEffect effect = {};
+	int failures = 0;
+
+	client.updateAEffect(&effect);
+	client.reserveAudioBuffers(Frames, Channels);
+
+	if (!client.m_connected || (stream && !client.openAudioStream())) {
+		fprintf(stderr, "FAIL: no %s audio\n", path);
+		return 1;
+	}
+
+	float input[Channels][Frames];
+	float output[Channels][Frames];
+	float *inputs[Channels] = {input[0], input[1]};
+	float *outputs[Channels] = {output[0], output[1]};
+	fillInput(input);
+
+	grpc_vst_communicatorClient::BlockBuffers steady = {};
+
+	for (int block = 0; block < WarmupBlocks + CountedBlocks; block++) {
+		if (block == WarmupBlocks)
+			steady = client.blockBuffers();
+
+		memset(output, 0, sizeof(output));
+
+		if (!client.processReplacing(&effect, inputs, Channels, outputs, Channels, Frames) || memcmp(input, output, sizeof(input)) != 0) {
+			fprintf(stderr, "FAIL: %s block %d wasn't echoed\n", path, block);
+			failures++;
+			break;
+		}
+	}
+
+	const grpc_vst_communicatorClient::BlockBuffers after = client.blockBuffers();
+	printf("%s: arena %llu -> %llu bytes over %d steady state blocks, payload buffers %s\n", path, (unsigned long long)steady.arenaBytes,
+	       (unsigned long long)after.arenaBytes, CountedBlocks, steady.input == after.input && steady.output == after.output ? "kept" : "moved");
+
+	if (after.arenaBytes != steady.arenaBytes || after.input != steady.input || after.output != steady.output) {
+		fprintf(stderr, "FAIL: the %s audio path reallocates its block messages\n", path);
+		failures++;
+	}
+
+	client.closeInstance();
+	return failures;
+}
+
+int main()
+{
+	EchoProxy proxy;
+	int port = 0;
+
+	grpc::ServerBuilder builder;
+	builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+	builder.RegisterService(&proxy);
+	std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+
+	if (server == nullptr || port == 0) {
+		fprintf(stderr, "FAIL: no server for the echo proxy\n");
+		return 1;
+	}
+
+	auto channel = grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials());
+	int failures = checkSharedAudio(channel, proxy);
+	failures += checkGrpcAudio(channel, false);
+	failures += checkGrpcAudio(channel, true);
+
+	server->Shutdown();
+	return failures == 0 ? 0 : 1;
+}
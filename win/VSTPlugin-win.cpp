@@ -15,121 +15,154 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 *****************************************************************************/
-#include "../headers/VSTPlugin.h"
-#include "VstWinDefs.h"
+#include "../headers/ProxyProcess.h"
 
-#include <obs_vst_api.grpc.pb.h>
-
-#include <util/platform.h>
-#define NOMINMAX
-#include <windows.h>
-#include <string>
+#include <obs-module.h>
 #include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ProxyProcesses {
+
+// Reads the proxy's ports until it reports them, exits or runs out of time
+static bool readPorts(HANDLE reader, HANDLE process, ProxyProcess &proxy)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ReportTimeoutMs);
+	std::string report;
+
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	if (overlapped.hEvent == NULL)
+		return false;
+
+	bool reported = false;
+
+	while (true) {
+		char buffer[64];
+		DWORD length = 0;
+
+		if (!ReadFile(reader, buffer, sizeof(buffer), &length, &overlapped)) {
+			if (GetLastError() != ERROR_IO_PENDING)
+				break;
+
+			// Wakes on the report or the proxy's exit, never polls
+			const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			const HANDLE waitHandles[] = {overlapped.hEvent, process};
 
-#include "../headers/grpc_vst_communicatorClient.h"
+			if (remaining <= 0 || WaitForMultipleObjects(2, waitHandles, FALSE, DWORD(remaining)) != WAIT_OBJECT_0) {
+				CancelIoEx(reader, &overlapped);
+				GetOverlappedResult(reader, &overlapped, &length, TRUE);
+				break;
+			}
+
+			if (!GetOverlappedResult(reader, &overlapped, &length, FALSE))
+				break;
+		}
+
+		report.append(buffer, length);
 
-using grpc::Channel;
-using grpc::ClientContext;
-using grpc::Status;
+		if (report.find('\n') != std::string::npos) {
+			reported = takePorts(report, proxy);
+			break;
+		}
+	}
+
+	CloseHandle(overlapped.hEvent);
+	return reported;
+}
 
-AEffect *VSTPlugin::loadEffect()
+std::shared_ptr<ProxyProcess> start(const std::string &modulePath)
 {
-	blog(LOG_DEBUG, "VST Plug-in: starting win-streamlabs-vst.exe for '%s'", m_pluginPath.c_str());
+	const char *module_path = obs_get_module_binary_path(obs_current_module());
+	if (!module_path)
+		return nullptr;
+
+	// Each launch reads from a pipe of its own, overlapped so the wait can include the proxy's exit
+	static std::atomic<uint32_t> launches{0};
+	const std::wstring pipeName = L"\\\\.\\pipe\\obs-vst-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(launches++);
+
+	HANDLE reader = CreateNamedPipeW(pipeName.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+					 PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 0, 256, 0, NULL);
+
+	if (reader == INVALID_HANDLE_VALUE) {
+		blog(LOG_ERROR, "VST Plug-in: can't create the proxy's report pipe, GetLastError = %d", GetLastError());
+		return nullptr;
+	}
 
-	wchar_t *wpath;
-	os_utf8_to_wcs_ptr(m_pluginPath.c_str(), 0, &wpath);
+	SECURITY_ATTRIBUTES inheritable = {sizeof(inheritable), NULL, TRUE};
+	HANDLE writer = CreateFileW(pipeName.c_str(), GENERIC_WRITE, 0, &inheritable, OPEN_EXISTING, 0, NULL);
 
-	const int32_t portNumber = chooseProxyPort();
+	if (writer == INVALID_HANDLE_VALUE) {
+		blog(LOG_ERROR, "VST Plug-in: can't open the proxy's report pipe, GetLastError = %d", GetLastError());
+		CloseHandle(reader);
+		return nullptr;
+	}
+
+	// The proxy inherits the write end and nothing else, other handles of OBS made inheritable elsewhere stay here
+	SIZE_T attributesSize = 0;
+	InitializeProcThreadAttributeList(NULL, 1, 0, &attributesSize);
+	std::vector<char> attributes(attributesSize);
 
-	STARTUPINFOW si;
+	STARTUPINFOEXW si;
 	memset(&si, NULL, sizeof(si));
-	si.cb = sizeof(si);
+	si.StartupInfo.cb = sizeof(si);
+	si.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.data());
 
-	m_effect = std::make_unique<AEffect>();
-	std::wstring startparams =
-		L"streamlabs_vst.exe \"" + std::wstring(wpath) + L"\" " + std::to_wstring(portNumber) + L" " + std::to_wstring(GetCurrentProcessId());
+	auto proxy = std::make_shared<ProxyProcess>();
 
 	BOOL launched = FALSE;
 	try {
-		const char *module_path = obs_get_module_binary_path(obs_current_module());
-		if (!module_path)
-			return nullptr;
-
+		// Ports of 0 let the proxy bind any free ones, it reports them through the pipe whose handle follows
+		std::wstring startparams = L"streamlabs_vst.exe \"" + std::filesystem::u8path(modulePath).wstring() + L"\" 0 " +
+					   std::to_wstring(GetCurrentProcessId()) + L" 0 " + std::to_wstring(uintptr_t(writer));
 		std::wstring process_path = std::filesystem::u8path(module_path).remove_filename().wstring() + L"/win-streamlabs-vst.exe";
 
-		launched =
-			CreateProcessW(process_path.c_str(), (LPWSTR)startparams.c_str(), NULL, NULL, FALSE, CREATE_NEW_CONSOLE, NULL, NULL, &si, &m_winServer);
+		if (InitializeProcThreadAttributeList(si.lpAttributeList, 1, 0, &attributesSize) &&
+		    UpdateProcThreadAttribute(si.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, &writer, sizeof(writer), NULL, NULL)) {
+			launched = CreateProcessW(process_path.c_str(), (LPWSTR)startparams.c_str(), NULL, NULL, TRUE,
+						  CREATE_NEW_CONSOLE | EXTENDED_STARTUPINFO_PRESENT, NULL, NULL, &si.StartupInfo, &proxy->info);
+			DeleteProcThreadAttributeList(si.lpAttributeList);
+		}
 	} catch (...) {
 		blog(LOG_ERROR, "VST Plug-in: Crashed while launching vst server");
 	}
-	if (!launched) {
-		::MessageBoxA(NULL,
-			      (std::filesystem::path(m_pluginPath).filename().string() +
-			       " failed to launch.\n\n You may restart the application or recreate the filter to try again.")
-				      .c_str(),
-			      "VST Filter Error", MB_ICONERROR | MB_TOPMOST);
 
+	// Only the proxy's copy keeps the pipe open from here, so its exit ends the read
+	CloseHandle(writer);
+
+	if (!launched) {
 		blog(LOG_ERROR, "VST Plug-in: can't start vst server, GetLastError = %d", GetLastError());
-		m_effect = nullptr;
+		CloseHandle(reader);
 		return nullptr;
 	}
 
-	m_remote = std::make_unique<grpc_vst_communicatorClient>(
-		grpc::CreateChannel("localhost:" + std::to_string(portNumber), grpc::InsecureChannelCredentials()));
-	m_remote->updateAEffect(m_effect.get());
+	const bool reported = readPorts(reader, proxy->info.hProcess, *proxy);
+	CloseHandle(reader);
 
-	if (!verifyProxy())
+	if (!reported) {
+		blog(LOG_ERROR, "VST Plug-in: vst server didn't report its ports");
+		kill(*proxy);
 		return nullptr;
+	}
 
-	return m_effect.get();
+	openChannels(*proxy);
+	return proxy;
 }
 
-int32_t VSTPlugin::chooseProxyPort()
+bool isRunning(ProxyProcess &proxy)
 {
-	int32_t result = 0;
-
-#ifdef WIN32
-	struct sockaddr_in local;
-	SOCKET sockt = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-
-	if (sockt == INVALID_SOCKET)
-		return result;
-
-	local.sin_addr.s_addr = htonl(INADDR_ANY);
-	local.sin_family = AF_INET;
-	local.sin_port = htons(0);
-
-	// Bind
-	if (::bind(sockt, (struct sockaddr *)&local, sizeof(local)) == SOCKET_ERROR)
-		return result;
-
-	struct sockaddr_in my_addr;
-	memset(&my_addr, NULL, sizeof(my_addr));
-	int len = sizeof(my_addr);
-	getsockname(sockt, (struct sockaddr *)&my_addr, &len);
-	result = ntohs(my_addr.sin_port);
-
-	closesocket(sockt);
-#endif
-	return result;
+	return WaitForSingleObject(proxy.info.hProcess, 0) == WAIT_TIMEOUT;
 }
 
-void VSTPlugin::stopProxy()
+void end(ProxyProcess &proxy, const int waitMs)
 {
-	if (m_effect == nullptr)
-		return;
-
-	auto movedPtr = move(m_effect);
-
-	if (m_remote == nullptr)
-		return;
-
-	m_remote->stopServer(movedPtr.get());
-
-	// Wait for graceful end in a thread, don't block here
 	std::thread(
-		[](HANDLE hProcess, HANDLE hThread, INT nWaitTime) {
+		[](HANDLE hProcess, HANDLE hThread, int nWaitTime) {
 			// Might have to kill it, wait a moment but note that wait time is 0 if tcp connection already isn't valid
 			if (WaitForSingleObject(hProcess, nWaitTime) == WAIT_TIMEOUT) {
 				if (TerminateProcess(hProcess, 0) == FALSE) {
@@ -140,8 +173,20 @@ void VSTPlugin::stopProxy()
 			CloseHandle(hProcess);
 			CloseHandle(hThread);
 		},
-		m_winServer.hProcess, m_winServer.hThread, m_proxyDisconnected ? 3000 : 0)
+		proxy.info.hProcess, proxy.info.hThread, waitMs)
 		.detach();
 
-	m_winServer = {};
+	proxy.info = {};
+}
+
+void kill(ProxyProcess &proxy)
+{
+	TerminateProcess(proxy.info.hProcess, 0);
+	WaitForSingleObject(proxy.info.hProcess, INFINITE);
+	CloseHandle(proxy.info.hProcess);
+	CloseHandle(proxy.info.hThread);
+
+	proxy.info = {};
+}
+
 }
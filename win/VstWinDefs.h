@@ -1,5 +1,10 @@
 #pragma once
 
+// Same message values on hosts without windows.h
+#ifndef WM_USER
+#define WM_USER 0x0400
+#endif
+
 namespace VstProxy {
 enum WM_USER_MSG {
 	// Start at index user + 5 because some plugins were causing issues when sending invalid